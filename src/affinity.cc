@@ -0,0 +1,203 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "affinity.h"
+#include "magic.h"
+
+bool PinThreads = false;
+bool ReplicateAttackTables = false;
+
+constexpr size_t MaximumCPUs = CPU_SETSIZE;
+constexpr size_t MaximumNodes = 64;
+
+
+struct CPU {
+        int number;
+        int package;
+        int core;
+        int node;
+        int sibling; // index among the hardware threads of its core
+};
+
+struct CPUTopology {
+        CPU     cpus[MaximumCPUs]; // in pinning order
+        size_t  number_of_cpus;
+
+        AttackTables* replicas[MaximumNodes];
+        mtx_t         replicas_lock;
+};
+
+CPUTopology Topology;
+once_flag TopologyOnce = ONCE_FLAG_INIT;
+
+
+// Read a single integer from a sysfs file, or return the fallback if it doesn't exist.
+int read_sysfs_int(char const* path, int fallback)
+{
+        FILE* file = fopen(path, "r");
+        if (file == nullptr) return fallback;
+
+        int value;
+        if (fscanf(file, "%d", &value) != 1) value = fallback;
+
+        fclose(file);
+        return value;
+}
+
+
+// Read a sysfs CPU list, e.g. "0-3,8-11", calling the visitor for every CPU in it.
+template <typename Visitor>
+bool read_cpu_list(char const* path, Visitor visit)
+{
+        FILE* file = fopen(path, "r");
+        if (file == nullptr) return false;
+
+        int first, last;
+
+        while (fscanf(file, "%d", &first) == 1) {
+                last = first;
+
+                int c = fgetc(file);
+                if (c == '-' && fscanf(file, "%d", &last) == 1) c = fgetc(file);
+
+                for (int cpu = first; cpu <= last; ++cpu) visit(cpu);
+                if (c != ',') break;
+        }
+
+        fclose(file);
+        return true;
+}
+
+
+int compare_cpus(void const* a, void const* b)
+{
+        auto& p = *(CPU const*) a;
+        auto& q = *(CPU const*) b;
+
+        if (p.sibling != q.sibling) return p.sibling - q.sibling;
+        return p.number - q.number;
+}
+
+
+void read_topology()
+{
+        auto& topology = Topology;
+        char path[128];
+
+        // Only use the CPUs we are allowed to run on, e.g. in a container.
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) CPU_ZERO(&allowed);
+
+        read_cpu_list("/sys/devices/system/cpu/online", [&](int cpu) {
+                if (cpu < 0 || (size_t) cpu >= MaximumCPUs || !CPU_ISSET(cpu, &allowed)) return;
+
+                auto& info = topology.cpus[topology.number_of_cpus++];
+                info = { .number = cpu, .package = 0, .core = cpu, .node = 0, .sibling = 0 };
+
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+                info.package = read_sysfs_int(path, 0);
+
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+                info.core = read_sysfs_int(path, cpu);
+        });
+
+        // Without sysfs, fall back to the online CPU count.
+        if (topology.number_of_cpus == 0) {
+                auto count = sysconf(_SC_NPROCESSORS_ONLN);
+
+                for (long cpu = 0; cpu < count && (size_t) cpu < MaximumCPUs; ++cpu) {
+                        topology.cpus[topology.number_of_cpus++] = { .number = (int) cpu, .package = 0, .core = (int) cpu, .node = 0, .sibling = 0 };
+                }
+        }
+
+        for (size_t node = 0; node < MaximumNodes; ++node) {
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+
+                read_cpu_list(path, [&](int cpu) {
+                        for (size_t i = 0; i < topology.number_of_cpus; ++i) {
+                                if (topology.cpus[i].number == cpu) topology.cpus[i].node = node;
+                        }
+                });
+        }
+
+        // Number the hardware threads of each core, which are listed in order of CPU number.
+        for (size_t i = 0; i < topology.number_of_cpus; ++i) {
+                auto& cpu = topology.cpus[i];
+
+                for (size_t j = 0; j < i; ++j) {
+                        auto& other = topology.cpus[j];
+                        if (other.package == cpu.package && other.core == cpu.core) cpu.sibling += 1;
+                }
+        }
+
+        qsort(topology.cpus, topology.number_of_cpus, sizeof(CPU), compare_cpus);
+        mtx_init(&topology.replicas_lock, mtx_plain);
+}
+
+
+// Get the attack tables of a node, copying them if this is the first thread on the node. The
+// copy is written by the calling thread, so that the kernel allocates its pages locally.
+
+AttackTables const* attack_tables_for_node(size_t node)
+{
+        auto& topology = Topology;
+        mtx_lock(&topology.replicas_lock);
+
+        auto& replica = topology.replicas[node];
+
+        if (replica == nullptr) {
+                void* memory = mmap(nullptr, sizeof(AttackTables), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+                if (memory != MAP_FAILED) {
+                        replica = (AttackTables*) memory;
+                        copy_attack_tables(*replica);
+                }
+        }
+
+        mtx_unlock(&topology.replicas_lock);
+        return replica ? replica : &PrimaryAttackTables;
+}
+
+
+void place_thread(size_t index)
+{
+        if (!PinThreads && !ReplicateAttackTables) return;
+
+        call_once(&TopologyOnce, read_topology);
+        auto& cpu = Topology.cpus[index % Topology.number_of_cpus];
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu.number, &set);
+
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) return; // e.g. restricted by a cpuset
+
+        if (ReplicateAttackTables && (size_t) cpu.node < MaximumNodes) {
+                select_attack_tables(*attack_tables_for_node(cpu.node));
+        }
+}
+
+
+CPUCounts count_cpus()
+{
+        call_once(&TopologyOnce, read_topology);
+        auto& topology = Topology;
+
+        CPUCounts counts = { .cpus = topology.number_of_cpus, .cores = 0, .packages = 0 };
+
+        for (size_t i = 0; i < topology.number_of_cpus; ++i) {
+                auto& cpu = topology.cpus[i];
+                if (cpu.sibling == 0) counts.cores += 1;
+
+                // Count each package at its first CPU.
+                bool first = true;
+                for (size_t j = 0; j < i; ++j) first &= topology.cpus[j].package != cpu.package;
+                counts.packages += first;
+        }
+
+        return counts;
+}
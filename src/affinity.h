@@ -0,0 +1,33 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ *   Placement of the worker threads of `threaded_perft`.
+ *
+ *   - With `PinThreads`, workers are pinned to CPUs in order of their physical cores first, and only
+ *     then to the SMT siblings of those cores, so that runs with fewer threads than CPUs never have
+ *     two threads sharing a core.
+ *
+ *   - With `ReplicateAttackTables`, every NUMA node gets its own copy of the attack tables (see
+ *     magic.h). The copy is made by the first worker pinned to the node, so that its pages are
+ *     allocated in the node's local memory, and then all workers on that node read from it. This
+ *     implies pinning, as otherwise threads could migrate away from their copy.
+ *
+ *   The topology is read from sysfs, if it is unavailable all CPUs are assumed to be separate cores
+ *   on a single node.
+ */
+
+extern bool PinThreads;
+extern bool ReplicateAttackTables;
+
+void place_thread(size_t index); // called by each worker as it starts, with its index
+
+
+// Counts of the CPUs we are allowed to run on, from the same topology.
+struct CPUCounts {
+        size_t cpus;     // hardware threads
+        size_t cores;    // physical cores
+        size_t packages;
+};
+
+CPUCounts count_cpus();
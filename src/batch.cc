@@ -0,0 +1,352 @@
+#ifdef PERFT_BATCHED_LEAVES
+
+#include <x86intrin.h>
+#include "batch.h"
+#include "bitboard.h"
+#include "board.h"
+
+// Vector of one bitboard per board in the batch, using GCC vector extensions so that the compiler
+// picks the widest registers of the target.
+typedef BitBoard Lanes __attribute__((vector_size(sizeof(BitBoard) * BatchLanes)));
+
+constexpr BitBoard Rank5BB = 0x0000'00ff'0000'0000;
+
+
+inline Lanes load_lanes(BitBoard const* bitboards) {
+        Lanes lanes;
+        __builtin_memcpy(&lanes, bitboards, sizeof(lanes));
+        return lanes;
+}
+
+
+// Lane-wise masks, all ones if the condition holds and zero otherwise.
+inline Lanes nonzero(Lanes bb) { return (Lanes) (bb != 0); }
+inline Lanes is_zero(Lanes bb) { return (Lanes) (bb == 0); }
+
+
+inline bool any(Lanes mask)
+{
+        BitBoard result = 0;
+        for (size_t i = 0; i < BatchLanes; ++i) result |= mask[i];
+
+        return result != 0;
+}
+
+
+inline Lanes popcount(Lanes bb)
+{
+#if defined(__AVX512VPOPCNTDQ__)
+        if constexpr (sizeof(Lanes) == sizeof(__m512i)) return (Lanes) _mm512_popcnt_epi64((__m512i) bb);
+#endif
+
+        bb = bb - ((bb >> 1) & 0x5555'5555'5555'5555);
+        bb = (bb & 0x3333'3333'3333'3333) + ((bb >> 2) & 0x3333'3333'3333'3333);
+        bb = (bb + (bb >> 4)) & 0x0f0f'0f0f'0f0f'0f0f;
+
+        // Sum the bytes with shifts, as 64-bit multiplies are slow (or missing) in vector registers.
+        bb += bb >> 8;
+        bb += bb >> 16;
+        bb += bb >> 32;
+
+        return bb & 0x7f;
+}
+
+
+// Mask of squares that a shift in a direction may land on, without wrapping around the board edges.
+template <Square Direction>
+constexpr BitBoard direction_mask()
+{
+        constexpr auto file = Direction & 7;
+
+        if (file == 1) return ~FileABB; // towards east
+        if (file == 7) return ~FileHBB; // towards west
+        return ~EmptyBB;
+}
+
+
+template <Square Direction>
+inline Lanes shift(Lanes bb, int steps = 1)
+{
+        if constexpr (Direction > 0) return bb << (Direction * steps);
+        else                         return bb >> (-Direction * steps);
+}
+
+
+template <Square Direction>
+inline Lanes step(Lanes bb)
+{
+        return shift<Direction>(bb) & direction_mask<Direction>();
+}
+
+
+// Kogge-Stone occluded fill from all pieces in a direction, giving the squares they attack,
+// including the first occupied square.
+template <Square Direction>
+inline Lanes slide(Lanes pieces, Lanes empty)
+{
+        empty &= direction_mask<Direction>();
+
+        pieces |= empty & shift<Direction>(pieces, 1);
+        empty  &= shift<Direction>(empty, 1);
+        pieces |= empty & shift<Direction>(pieces, 2);
+        empty  &= shift<Direction>(empty, 2);
+        pieces |= empty & shift<Direction>(pieces, 4);
+
+        return step<Direction>(pieces);
+}
+
+
+constexpr Square NorthEast = North + East, NorthWest = North + West;
+constexpr Square SouthEast = South + East, SouthWest = South + West;
+
+
+inline Lanes knight_attacks(Lanes bb)
+{
+        return step<North>(step<NorthEast>(bb)) | step<North>(step<NorthWest>(bb))
+             | step<South>(step<SouthEast>(bb)) | step<South>(step<SouthWest>(bb))
+             | step<East>(step<NorthEast>(bb))  | step<East>(step<SouthEast>(bb))
+             | step<West>(step<NorthWest>(bb))  | step<West>(step<SouthWest>(bb));
+}
+
+
+inline Lanes count_knight_moves(Lanes bb, Lanes targets)
+{
+        // Each knight jump is a different direction, so no square is reached twice per jump.
+        return popcount(step<North>(step<NorthEast>(bb)) & targets) + popcount(step<North>(step<NorthWest>(bb)) & targets)
+             + popcount(step<South>(step<SouthEast>(bb)) & targets) + popcount(step<South>(step<SouthWest>(bb)) & targets)
+             + popcount(step<East>(step<NorthEast>(bb)) & targets)  + popcount(step<East>(step<SouthEast>(bb)) & targets)
+             + popcount(step<West>(step<NorthWest>(bb)) & targets)  + popcount(step<West>(step<SouthWest>(bb)) & targets);
+}
+
+
+inline Lanes king_attacks(Lanes bb)
+{
+        return step<North>(bb) | step<South>(bb) | step<East>(bb) | step<West>(bb)
+             | step<NorthEast>(bb) | step<NorthWest>(bb) | step<SouthEast>(bb) | step<SouthWest>(bb);
+}
+
+
+// Count the legal moves of the boards in lanes [index, index + BatchLanes), mirroring `count_moves`
+// in movegen.cc step by step.
+
+Lanes count_lanes(BoardBatch const& batch, size_t index)
+{
+        auto x   = load_lanes(batch.x   + index);
+        auto y   = load_lanes(batch.y   + index);
+        auto z   = load_lanes(batch.z   + index);
+        auto our = load_lanes(batch.our + index);
+
+        auto occ   = x | y | z;
+        auto ours  = occ & our;
+        auto enemy = occ &~ our;
+        auto en_passant = our &~ occ;
+
+        auto pawns   = x &~ y &~ z;
+        auto knights = ~x & y &~ z;
+        auto bishops = x & y &~ z;
+        auto rooks   = z &~ y; // including castles
+        auto castles = x &~ y & z;
+        auto queens  = ~x & y & z;
+        auto kings   = x & y & z;
+
+        auto king = kings & our;
+
+        auto enemy_diagonal   = (bishops | queens) & enemy;
+        auto enemy_orthogonal = (rooks | queens) & enemy;
+
+        // Squares attacked by the enemy, where sliders see through our king.
+        auto empty_without_king = ~(occ &~ king);
+
+        auto attacked = step<SouthEast>(pawns & enemy) | step<SouthWest>(pawns & enemy)
+                      | knight_attacks(knights & enemy)
+                      | king_attacks(kings & enemy)
+                      | slide<NorthEast>(enemy_diagonal, empty_without_king)
+                      | slide<NorthWest>(enemy_diagonal, empty_without_king)
+                      | slide<SouthEast>(enemy_diagonal, empty_without_king)
+                      | slide<SouthWest>(enemy_diagonal, empty_without_king)
+                      | slide<North>(enemy_orthogonal, empty_without_king)
+                      | slide<South>(enemy_orthogonal, empty_without_king)
+                      | slide<East>(enemy_orthogonal, empty_without_king)
+                      | slide<West>(enemy_orthogonal, empty_without_king);
+
+        // Rays from our king, first up to the first blocker, and then after removing the first of our
+        // pieces on every ray, up to the pinning pieces. The first four directions are diagonal.
+        Lanes rays[8], xrays[8];
+
+        rays[0] = slide<NorthEast>(king, ~occ);
+        rays[1] = slide<NorthWest>(king, ~occ);
+        rays[2] = slide<SouthEast>(king, ~occ);
+        rays[3] = slide<SouthWest>(king, ~occ);
+        rays[4] = slide<North>(king, ~occ);
+        rays[5] = slide<South>(king, ~occ);
+        rays[6] = slide<East>(king, ~occ);
+        rays[7] = slide<West>(king, ~occ);
+
+        auto all_rays = rays[0] | rays[1] | rays[2] | rays[3] | rays[4] | rays[5] | rays[6] | rays[7];
+        auto remove_blockers = ~((occ &~ king) &~ (all_rays & ours));
+
+        xrays[0] = slide<NorthEast>(king, remove_blockers);
+        xrays[1] = slide<NorthWest>(king, remove_blockers);
+        xrays[2] = slide<SouthEast>(king, remove_blockers);
+        xrays[3] = slide<SouthWest>(king, remove_blockers);
+        xrays[4] = slide<North>(king, remove_blockers);
+        xrays[5] = slide<South>(king, remove_blockers);
+        xrays[6] = slide<East>(king, remove_blockers);
+        xrays[7] = slide<West>(king, remove_blockers);
+
+        auto checks = (pawns & enemy & (step<NorthEast>(king) | step<NorthWest>(king)))
+                    | (knights & enemy & knight_attacks(king));
+
+        auto pinned_diagonally = Lanes{};
+        auto pinned_orthogonally = Lanes{};
+
+        for (size_t i = 0; i < 8; ++i) {
+                auto sliders = (i < 4) ? enemy_diagonal : enemy_orthogonal;
+                auto pins = xrays[i] & nonzero(xrays[i] & sliders);
+                checks |= rays[i] & sliders;
+
+                if (i < 4) pinned_diagonally |= pins;
+                else       pinned_orthogonally |= pins;
+        }
+
+        // King moves, including castling (only possible if our king is still on E1).
+        auto targets = ~ours;
+        auto count = popcount(king_attacks(king) & targets &~ attacked);
+
+        constexpr auto QueensideInbetween = (OneBB << C1 | OneBB << D1 | OneBB << E1);
+        constexpr auto KingsideInbetween = (OneBB << E1 | OneBB << F1 | OneBB << G1);
+
+        auto on_e1 = (Lanes) (king == (OneBB << E1));
+        auto queenside = rays[7] & castles & (OneBB << A1);
+        auto kingside  = rays[6] & castles & (OneBB << H1);
+
+        count += on_e1 & nonzero(queenside) & is_zero(attacked & QueensideInbetween) & 1;
+        count += on_e1 & nonzero(kingside)  & is_zero(attacked & KingsideInbetween)  & 1;
+
+        // In double check, only the king can move. Otherwise we must block or capture a single checker,
+        // where the ray from our king that contains the checker is exactly the line between them.
+        auto double_check = nonzero(checks & (checks - 1));
+        auto check_line = checks;
+
+        for (auto ray : rays) check_line |= ray & nonzero(ray & checks);
+
+        targets &= (check_line & nonzero(checks)) | is_zero(checks);
+
+        // Pawn moves, including the rare case of an en-passant pinned along the fifth rank.
+        auto our_pawns = pawns & ours;
+        auto candidates = our_pawns & step<South>(step<East>(en_passant) | step<West>(en_passant));
+        auto single_candidate = nonzero(candidates) & is_zero(candidates & (candidates - 1));
+        auto maybe_pinned = single_candidate & nonzero(king & Rank5BB);
+
+        if (any(maybe_pinned)) {
+                auto clear = candidates | step<South>(en_passant);
+                auto empty = ~(occ &~ clear);
+                auto rook_attacks = slide<North>(king, empty) | slide<South>(king, empty)
+                                  | slide<East>(king, empty)  | slide<West>(king, empty);
+
+                en_passant &= ~(maybe_pinned & nonzero(rook_attacks & enemy_orthogonal));
+        }
+
+        auto pawn_targets = targets | (en_passant & step<North>(targets));
+        auto pawn_enemy = enemy | en_passant;
+
+        auto pinned = pinned_diagonally | pinned_orthogonally;
+        auto unpinned_pawns = our_pawns &~ pinned;
+
+        auto file = king;
+        file |= (file << 8)  | (file >> 8);
+        file |= (file << 16) | (file >> 16);
+        file |= (file << 32) | (file >> 32);
+
+        auto forward = unpinned_pawns | (our_pawns & pinned_orthogonally & file);
+
+        auto single_move = step<North>(forward) &~ occ;
+        auto double_move = step<North>(single_move & Rank3BB) &~ occ;
+
+        auto east_capture = step<NorthEast>(unpinned_pawns) & pawn_enemy;
+        auto west_capture = step<NorthWest>(unpinned_pawns) & pawn_enemy;
+
+        auto pinned_east_capture = step<NorthEast>(our_pawns & pinned_diagonally) & pawn_enemy & pinned_diagonally;
+        auto pinned_west_capture = step<NorthWest>(our_pawns & pinned_diagonally) & pawn_enemy & pinned_diagonally;
+
+        single_move  = single_move & pawn_targets;
+        double_move  = double_move & pawn_targets;
+        east_capture = (east_capture | pinned_east_capture) & pawn_targets;
+        west_capture = (west_capture | pinned_west_capture) & pawn_targets;
+
+        auto others = popcount((single_move &~ Rank8BB) | double_move)
+                    + popcount(east_capture &~ Rank8BB)
+                    + popcount(west_capture &~ Rank8BB)
+                    + popcount(single_move  & Rank8BB) * 4
+                    + popcount(east_capture & Rank8BB) * 4
+                    + popcount(west_capture & Rank8BB) * 4;
+
+        // Moves of unpinned pieces, and of pinned pieces along their pins (pinned knights can't move).
+        auto diagonal   = (bishops | queens) & ours;
+        auto orthogonal = (rooks   | queens) & ours;
+
+        auto unpinned_diagonal   = diagonal &~ pinned;
+        auto unpinned_orthogonal = orthogonal &~ pinned;
+        auto pinned_diagonal     = diagonal & pinned_diagonally;
+        auto pinned_orthogonal   = orthogonal & pinned_orthogonally;
+
+        auto diagonal_targets   = targets & pinned_diagonally;
+        auto orthogonal_targets = targets & pinned_orthogonally;
+
+        others += count_knight_moves(knights & ours &~ pinned, targets);
+
+        others += popcount(slide<NorthEast>(unpinned_diagonal, ~occ) & targets)
+                + popcount(slide<NorthWest>(unpinned_diagonal, ~occ) & targets)
+                + popcount(slide<SouthEast>(unpinned_diagonal, ~occ) & targets)
+                + popcount(slide<SouthWest>(unpinned_diagonal, ~occ) & targets)
+                + popcount(slide<North>(unpinned_orthogonal, ~occ) & targets)
+                + popcount(slide<South>(unpinned_orthogonal, ~occ) & targets)
+                + popcount(slide<East>(unpinned_orthogonal, ~occ) & targets)
+                + popcount(slide<West>(unpinned_orthogonal, ~occ) & targets);
+
+        others += popcount(slide<NorthEast>(pinned_diagonal, ~occ) & diagonal_targets)
+                + popcount(slide<NorthWest>(pinned_diagonal, ~occ) & diagonal_targets)
+                + popcount(slide<SouthEast>(pinned_diagonal, ~occ) & diagonal_targets)
+                + popcount(slide<SouthWest>(pinned_diagonal, ~occ) & diagonal_targets)
+                + popcount(slide<North>(pinned_orthogonal, ~occ) & orthogonal_targets)
+                + popcount(slide<South>(pinned_orthogonal, ~occ) & orthogonal_targets)
+                + popcount(slide<East>(pinned_orthogonal, ~occ) & orthogonal_targets)
+                + popcount(slide<West>(pinned_orthogonal, ~occ) & orthogonal_targets);
+
+        return count + (others &~ double_check);
+}
+
+
+uint64_t count_moves(BoardBatch& batch)
+{
+        if (batch.size == 0) return 0;
+
+        // Pad the last vector with copies of the first board, and mask out their counts below.
+        auto padded_size = (batch.size + BatchLanes - 1) / BatchLanes * BatchLanes;
+
+        for (auto i = batch.size; i < padded_size; ++i) {
+                batch.x[i] = batch.x[0];
+                batch.y[i] = batch.y[0];
+                batch.z[i] = batch.z[0];
+                batch.our[i] = batch.our[0];
+        }
+
+        auto total = Lanes{};
+
+        for (size_t i = 0; i + BatchLanes < padded_size; i += BatchLanes) {
+                total += count_lanes(batch, i);
+        }
+
+        auto last = count_lanes(batch, padded_size - BatchLanes);
+
+        for (size_t i = 0; i < BatchLanes; ++i) {
+                if (padded_size - BatchLanes + i < batch.size) total[i] += last[i];
+        }
+
+        uint64_t sum = 0;
+        for (size_t i = 0; i < BatchLanes; ++i) sum += total[i];
+
+        return sum;
+}
+
+#endif
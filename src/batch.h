@@ -0,0 +1,47 @@
+#pragma once
+#include "bitboard.h"
+#include "board.h"
+#include "movegen.h"
+
+/*
+ *   Batched leaf counting. Instead of counting the moves of one board at a time, the boards are
+ *   stored as a structure of arrays, so that the moves of `BatchLanes` boards are counted together
+ *   in the lanes of vector registers (AVX2 or AVX-512, depending on the target).
+ *
+ *   The magic bitboard lookups and loops over pieces of the scalar move generator don't vectorise,
+ *   so here all attacks are generated set-wise, with Kogge-Stone fills in each of the eight ray
+ *   directions. Along a single direction, a square can only be reached by one piece, so summing the
+ *   population counts over all directions gives exactly the number of moves of all pieces at once.
+ *   The results are identical to `count_moves`.
+ */
+
+// One vector register of bitboards, so that vectors never have to be passed in memory.
+#if defined(__AVX512F__)
+constexpr size_t BatchLanes = 8;
+#elif defined(__AVX__)
+constexpr size_t BatchLanes = 4;
+#else
+constexpr size_t BatchLanes = 2;
+#endif
+
+// Big enough for all children of any node, rounded up to a whole number of vectors.
+constexpr size_t BoardBatchCapacity = (MaximumLegalMoves + BatchLanes - 1) / BatchLanes * BatchLanes;
+
+struct alignas(64) BoardBatch {
+        BitBoard x  [BoardBatchCapacity];
+        BitBoard y  [BoardBatchCapacity];
+        BitBoard z  [BoardBatchCapacity];
+        BitBoard our[BoardBatchCapacity];
+        size_t   size;
+
+        void push(Board const& board) {
+                x  [size] = board.x;
+                y  [size] = board.y;
+                z  [size] = board.z;
+                our[size] = board.our;
+                size += 1;
+        }
+};
+
+
+uint64_t count_moves(BoardBatch& batch); // total over all boards of the batch
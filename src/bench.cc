@@ -0,0 +1,571 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+#include "bench.h"
+#include "counters.h"
+#include "fen.h"
+#include "hash.h"
+#include "magic.h"
+#include "perft.h"
+
+// Unit-test results we obtained from (https://www.chessprogramming.org/Perft_Results)
+const PerftTest PerftTests[NumberOfPerftTests] =
+{
+        { .name = "startpos",
+          .FEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+          .depth = 6,
+          .expected = { 20, 400, 8902, 197281, 4865609, 119060324 },
+        },
+
+        { .name = "kiwipete",
+          .FEN = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -",
+          .depth = 5,
+          .expected = { 48, 2039, 97862, 4085603, 193690690 },
+        },
+
+        { .name = "tricky en-passant",
+          .FEN = "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -",
+          .depth = 7,
+          .expected = { 14, 191, 2812, 43238, 674624, 11030083, 178633661 },
+        },
+
+        { .name = "tricky castling",
+          .FEN = "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq -",
+          .depth = 6,
+          .expected = { 6, 264, 9467, 422333, 15833292, 706045033 },
+        },
+
+        { .name = "tricky castling rotated",
+          .FEN = "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ -",
+          .depth = 6,
+          .expected = { 6, 264, 9467, 422333, 15833292, 706045033 },
+        },
+
+        { .name = "talkchess",
+          .FEN = "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ -",
+          .depth = 5,
+          .expected = { 44, 1486, 62379, 2103487, 89941194 },
+        },
+
+        { .name = "normal middlegame",
+          .FEN = "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - -",
+          .depth = 5,
+          .expected = { 46, 2079, 89890, 3894594, 164075551 },
+        },
+};
+
+
+struct BenchResult {
+        Nodes    nodes;
+        bool     passed;
+
+        Seconds* seconds; // of each repetition, sorted
+        Seconds  mean;
+        Seconds  median;
+        Seconds  minimum;
+        Seconds  deviation;
+
+        bool     counted;
+        double   counts[NumberOfPerfCounters]; // per node, negative if unavailable
+
+        bool     compared;
+        Seconds  baseline_median;
+        double   p_value;
+        bool     regression;
+};
+
+struct BaselineEntry {
+        Seconds* seconds;
+        size_t   number_of_seconds;
+};
+
+constexpr double RegressionSignificance = 0.05;
+
+
+double mean_of(Seconds const samples[], size_t n)
+{
+        double sum = 0.0;
+        for (size_t i = 0; i < n; ++i) sum += samples[i];
+        return sum / n;
+}
+
+double variance_of(Seconds const samples[], size_t n, double mean)
+{
+        if (n < 2) return 0.0;
+
+        double sum = 0.0;
+        for (size_t i = 0; i < n; ++i) sum += (samples[i] - mean) * (samples[i] - mean);
+        return sum / (n - 1);
+}
+
+
+// Regularised incomplete beta function I_x(a, b), evaluated by its continued fraction with the
+// modified Lentz method (Numerical Recipes, section 6.4).
+
+double incomplete_beta(double x, double a, double b)
+{
+        if (x <= 0.0) return 0.0;
+        if (x >= 1.0) return 1.0;
+
+        // The continued fraction only converges quickly below this point, otherwise use the symmetry.
+        if (x > (a + 1.0) / (a + b + 2.0)) return 1.0 - incomplete_beta(1.0 - x, b, a);
+
+        constexpr double Tiny = 1.0e-30;
+
+        auto front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1.0 - x)) / a;
+        double f = 1.0, c = 1.0, d = 0.0;
+
+        for (int i = 0; i <= 200; ++i) {
+                double m = i / 2, numerator;
+
+                if (i == 0) numerator = 1.0;
+                else if (i % 2 == 0) numerator = (m * (b - m) * x) / ((a + 2.0 * m - 1.0) * (a + 2.0 * m));
+                else numerator = -((a + m) * (a + b + m) * x) / ((a + 2.0 * m) * (a + 2.0 * m + 1.0));
+
+                d = 1.0 + numerator * d;
+                d = 1.0 / (fabs(d) < Tiny ? Tiny : d);
+
+                c = 1.0 + numerator / c;
+                if (fabs(c) < Tiny) c = Tiny;
+
+                f *= c * d;
+                if (fabs(1.0 - c * d) < 1.0e-10) break;
+        }
+
+        return front * (f - 1.0);
+}
+
+
+// One-sided p-value of Welch's t-test, for the times `b` having a larger mean than the times `a`.
+double welch_p_value(Seconds const a[], size_t na, Seconds const b[], size_t nb)
+{
+        auto mean_a = mean_of(a, na), mean_b = mean_of(b, nb);
+        auto error_a = variance_of(a, na, mean_a) / na;
+        auto error_b = variance_of(b, nb, mean_b) / nb;
+
+        if (error_a + error_b == 0.0) return mean_b > mean_a ? 0.0 : 1.0;
+
+        auto t = (mean_b - mean_a) / sqrt(error_a + error_b);
+        auto df = (error_a + error_b) * (error_a + error_b)
+                / (error_a * error_a / (na - 1) + error_b * error_b / (nb - 1));
+
+        // The two-sided tail probability of Student's t-distribution is I_{df/(df+t^2)}(df/2, 1/2).
+        auto tail = 0.5 * incomplete_beta(df / (df + t * t), 0.5 * df, 0.5);
+        return t > 0 ? tail : 1.0 - tail;
+}
+
+
+int compare_seconds(void const* a, void const* b)
+{
+        auto p = *(Seconds const*) a;
+        auto q = *(Seconds const*) b;
+        return (p > q) - (p < q);
+}
+
+
+// Load the times of each test position from a JSON report written by an earlier bench. This only
+// reads what the bench writes, with one position per line.
+
+bool load_baseline(char const* path, BaselineEntry baseline[NumberOfPerftTests])
+{
+        FILE* file = fopen(path, "r");
+
+        if (file == nullptr) {
+                fprintf(stderr, "error: failed to open baseline %s.\n", path);
+                return false;
+        }
+
+        char line[4096];
+        size_t found = 0;
+
+        while (fgets(line, sizeof(line), file)) {
+                auto name = strstr(line, "\"name\": \"");
+                auto seconds = strstr(line, "\"seconds\": [");
+                if (name == nullptr || seconds == nullptr) continue;
+
+                name += strlen("\"name\": \"");
+                auto name_length = strcspn(name, "\"");
+
+                for (size_t index = 0; index < NumberOfPerftTests; ++index) {
+                        auto test_name = PerftTests[index].name;
+                        if (strlen(test_name) != name_length || strncmp(name, test_name, name_length) != 0) continue;
+
+                        auto& entry = baseline[index];
+                        delete[] entry.seconds;
+
+                        // There are fewer times than characters.
+                        entry.seconds = new Seconds[strlen(seconds)];
+                        entry.number_of_seconds = 0;
+
+                        char* cursor = seconds + strlen("\"seconds\": [");
+                        char* end;
+
+                        for (auto time = strtod(cursor, &end); end != cursor; time = strtod(cursor, &end)) {
+                                entry.seconds[entry.number_of_seconds++] = time;
+                                cursor = end + strspn(end, ", ");
+                        }
+
+                        found += 1;
+                }
+        }
+
+        fclose(file);
+
+        if (found == 0) {
+                fprintf(stderr, "error: no bench positions found in baseline %s.\n", path);
+                return false;
+        }
+
+        return true;
+}
+
+
+// Print the performance counters of a bench test, per node.
+void print_perf_counters(double const counts[NumberOfPerfCounters])
+{
+        constexpr char const* names[NumberOfPerfCounters] = {
+                "cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses", "dTLB-misses",
+        };
+
+        printf("    ");
+
+        if (counts[CyclesCounter] > 0 && counts[InstructionsCounter] >= 0) {
+                printf("IPC %.2f, ", counts[InstructionsCounter] / counts[CyclesCounter]);
+        }
+
+        printf("per node:");
+
+        for (int counter = 0; counter < NumberOfPerfCounters; ++counter) {
+                if (counts[counter] >= 0) printf(" %s %.3f", names[counter], counts[counter]);
+        }
+
+        printf("\n");
+}
+
+
+void print_json_report(BenchOptions const& options, BenchResult const results[], double average)
+{
+        constexpr char const* names[NumberOfPerfCounters] = {
+                "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses", "dtlb_misses",
+        };
+
+        printf("{\n");
+        printf("  \"threads\": %zu,\n", options.number_of_threads);
+        printf("  \"warmup\": %zu,\n", options.warmup);
+        printf("  \"repetitions\": %zu,\n", options.repetitions);
+        printf("  \"sliders\": \"%s\",\n", SelectedSliders == PextSliders ? "pext" : "magic");
+        printf("  \"positions\": [\n");
+
+        for (size_t index = 0; index < NumberOfPerftTests; ++index) {
+                auto& test = PerftTests[index];
+                auto& result = results[index];
+
+                printf("    { \"name\": \"%s\", \"depth\": %u, \"nodes\": %lu, \"passed\": %s, ",
+                       test.name, test.depth, result.nodes, result.passed ? "true" : "false");
+
+                printf("\"median_seconds\": %.6f, \"min_seconds\": %.6f, \"stddev_seconds\": %.6f, \"median_gnps\": %.4f, ",
+                       result.median, result.minimum, result.deviation, result.nodes / result.median / 1.0e9);
+
+                if (result.counted) {
+                        printf("\"counters_per_node\": {");
+
+                        bool first = true;
+
+                        for (int counter = 0; counter < NumberOfPerfCounters; ++counter) {
+                                if (result.counts[counter] < 0) continue;
+
+                                printf("%s \"%s\": %.4f", first ? "" : ",", names[counter], result.counts[counter]);
+                                first = false;
+                        }
+
+                        printf(" }, ");
+                }
+
+                if (result.compared) {
+                        printf("\"baseline_median_seconds\": %.6f, \"p_value\": %.4f, \"regression\": %s, ",
+                               result.baseline_median, result.p_value, result.regression ? "true" : "false");
+                }
+
+                printf("\"seconds\": [");
+
+                for (size_t i = 0; i < options.repetitions; ++i) {
+                        printf("%s%.6f", i ? ", " : "", result.seconds[i]);
+                }
+
+                printf("] }%s\n", index + 1 < NumberOfPerftTests ? "," : "");
+        }
+
+        printf("  ],\n");
+        printf("  \"median_gnps\": %.4f\n", average);
+        printf("}\n");
+}
+
+
+void print_comparison(char const* baseline_path, BenchResult const results[])
+{
+        printf("\nComparison with %s:\n\n", baseline_path);
+        printf("name                        baseline       current     change   p-value\n");
+        printf("=======================================================================\n");
+
+        for (size_t index = 0; index < NumberOfPerftTests; ++index) {
+                auto& test = PerftTests[index];
+                auto& result = results[index];
+
+                if (!result.compared) {
+                        printf("%-25s %13s\n", test.name, "-");
+                        continue;
+                }
+
+                auto baseline = result.nodes / result.baseline_median / 1.0e9;
+                auto current = result.nodes / result.median / 1.0e9;
+
+                printf("%-25s %6.3f Gnps   %6.3f Gnps   %+7.2f%%  ", test.name, baseline, current, 100.0 * (current / baseline - 1.0));
+
+                if (isnan(result.p_value)) printf("%8s", "-");
+                else printf("%8.4f", result.p_value);
+
+                printf("%s\n", result.regression ? "   REGRESSION" : "");
+        }
+}
+
+
+// The median of sorted times.
+Seconds median_of(Seconds const seconds[], size_t n)
+{
+        return n % 2 ? seconds[n / 2] : 0.5 * (seconds[n / 2 - 1] + seconds[n / 2]);
+}
+
+
+void run_bench_position(PerftTest const& test, BenchOptions const& options, BenchResult& result)
+{
+        Board board;
+        FENInfo info;
+
+        auto error = parse_fen(test.FEN, board, info);
+        assert(error == FENOk && "FEN parsing failed!");
+
+        auto repetitions = options.repetitions;
+        auto expected = test.expected[test.depth - 1];
+
+        result = {};
+        result.passed = true;
+        result.seconds = new Seconds[repetitions];
+
+        // Untimed runs, to warm up the caches, branch predictors and clock speed.
+        for (size_t i = 0; i < options.warmup; ++i) {
+                clear_tt();
+                threaded_perft(board, test.depth, options.number_of_threads);
+        }
+
+        PerfCounters perf_counters;
+        result.counted = options.counters && open_perf_counters(perf_counters);
+
+        for (size_t i = 0; i < repetitions; ++i) {
+                // Don't let results of previous runs inflate our numbers.
+                clear_tt();
+
+                auto t1 = get_time_from_os();
+                result.nodes = threaded_perft(board, test.depth, options.number_of_threads);
+                auto t2 = get_time_from_os();
+
+                result.seconds[i] = t2 - t1;
+                result.passed &= result.nodes == expected;
+        }
+
+        if (result.counted) {
+                close_perf_counters(perf_counters, result.counts);
+
+                for (auto& count : result.counts) {
+                        if (count >= 0) count /= (double) result.nodes * repetitions;
+                }
+        }
+
+        result.mean = mean_of(result.seconds, repetitions);
+        result.deviation = sqrt(variance_of(result.seconds, repetitions, result.mean));
+
+        qsort(result.seconds, repetitions, sizeof(Seconds), compare_seconds);
+        result.minimum = result.seconds[0];
+        result.median = median_of(result.seconds, repetitions);
+}
+
+
+bool bench(BenchOptions const& options)
+{
+        BaselineEntry baseline[NumberOfPerftTests] = {};
+        if (options.baseline && !load_baseline(options.baseline, baseline)) return false;
+
+        auto repetitions = options.repetitions;
+        BenchResult results[NumberOfPerftTests];
+
+        Seconds total_time = 0.0;
+        Nodes total_nodes = 0;
+        bool ok = true;
+
+        if (!options.json) {
+                printf("name                      depth       nodes        median          best    stddev\n");
+                printf("=================================================================================\n");
+        }
+
+        for (size_t index = 0; index < NumberOfPerftTests; index += 1)
+        {
+                auto& test = PerftTests[index];
+                auto& result = results[index];
+
+                run_bench_position(test, options, result);
+
+                if (baseline[index].number_of_seconds > 0) {
+                        auto& entry = baseline[index];
+                        qsort(entry.seconds, entry.number_of_seconds, sizeof(Seconds), compare_seconds);
+
+                        auto n = entry.number_of_seconds;
+                        result.compared = true;
+                        result.baseline_median = median_of(entry.seconds, n);
+
+                        // Significance can only be tested with the variance of both runs.
+                        result.p_value = (n >= 2 && repetitions >= 2) ? welch_p_value(entry.seconds, n, result.seconds, repetitions) : NAN;
+                        result.regression = result.p_value < RegressionSignificance;
+                }
+
+                ok &= result.passed && !result.regression;
+
+                total_nodes += result.nodes;
+                total_time += result.median;
+
+                if (options.json) continue;
+
+                printf("%-25s %-5u   %9zu   %6.3f Gnps   %6.3f Gnps   %6.2f%%\n", test.name, test.depth, result.nodes,
+                       result.nodes / result.median / 1.0e9, result.nodes / result.minimum / 1.0e9, 100.0 * result.deviation / result.mean);
+
+                if (!result.passed) printf("    FAILED, expected %lu nodes.\n", test.expected[test.depth - 1]);
+                if (result.counted) print_perf_counters(result.counts);
+                if (TT.enabled()) print_tt_stats();
+        }
+
+        auto average = total_nodes / total_time / 1.0e9;
+
+        if (options.json) {
+                print_json_report(options, results, average);
+        }
+
+        else {
+                printf("\nAverage nodes per second: %6.3f Gnps\n", average);
+                if (options.baseline) print_comparison(options.baseline, results);
+        }
+
+        for (size_t index = 0; index < NumberOfPerftTests; ++index) {
+                delete[] results[index].seconds;
+                delete[] baseline[index].seconds;
+        }
+
+        return ok;
+}
+
+
+struct ScalingPoint {
+        size_t      threads;
+        char const* label;
+        double      gnps;
+};
+
+
+void add_scaling_point(ScalingPoint points[], size_t& number_of_points, size_t threads, char const* label)
+{
+        for (size_t i = 0; i < number_of_points; ++i) {
+                if (points[i].threads != threads) continue;
+                if (label) points[i].label = label;
+                return;
+        }
+
+        // Keep the points sorted by thread count.
+        size_t i = number_of_points++;
+        for (; i > 0 && points[i - 1].threads > threads; --i) points[i] = points[i - 1];
+
+        points[i] = { .threads = threads, .label = label, .gnps = 0.0 };
+}
+
+
+bool scaling(BenchOptions const& options)
+{
+        auto maximum = options.number_of_threads;
+        auto counts = count_cpus();
+
+        ScalingPoint points[128];
+        size_t number_of_points = 0;
+
+        for (size_t threads = 1; threads <= maximum && number_of_points < 64; threads *= 2) {
+                add_scaling_point(points, number_of_points, threads, nullptr);
+        }
+
+        if (counts.packages > 1 && counts.cores / counts.packages <= maximum) {
+                add_scaling_point(points, number_of_points, counts.cores / counts.packages, "cores of one package");
+        }
+
+        if (counts.cores <= maximum) add_scaling_point(points, number_of_points, counts.cores, "all cores");
+        if (counts.cpus <= maximum)  add_scaling_point(points, number_of_points, counts.cpus, "all cpus");
+        add_scaling_point(points, number_of_points, maximum, nullptr);
+
+        if (!options.json) {
+                printf("Scaling up to %zu threads, on %zu cpus, %zu cores and %zu packages.\n\n",
+                       maximum, counts.cpus, counts.cores, counts.packages);
+
+                printf("threads        Gnps     speedup   efficiency\n");
+                printf("============================================\n");
+        }
+
+        bool ok = true;
+
+        for (size_t p = 0; p < number_of_points; ++p) {
+                auto& point = points[p];
+
+                auto point_options = options;
+                point_options.number_of_threads = point.threads;
+                point_options.counters = false;
+
+                Seconds total_time = 0.0;
+                Nodes total_nodes = 0;
+
+                for (size_t index = 0; index < NumberOfPerftTests; ++index) {
+                        BenchResult result;
+                        run_bench_position(PerftTests[index], point_options, result);
+
+                        ok &= result.passed;
+                        total_nodes += result.nodes;
+                        total_time += result.median;
+
+                        delete[] result.seconds;
+                }
+
+                point.gnps = total_nodes / total_time / 1.0e9;
+
+                if (options.json) continue;
+
+                auto speedup = point.gnps / points[0].gnps;
+                printf("%7zu %11.3f %10.2fx %11.1f%%", point.threads, point.gnps, speedup, 100.0 * speedup / point.threads);
+                printf(point.label ? "   %s\n" : "\n", point.label);
+        }
+
+        if (options.json) {
+                printf("{\n");
+                printf("  \"cpus\": %zu, \"cores\": %zu, \"packages\": %zu,\n", counts.cpus, counts.cores, counts.packages);
+                printf("  \"warmup\": %zu, \"repetitions\": %zu,\n", options.warmup, options.repetitions);
+                printf("  \"points\": [\n");
+
+                for (size_t p = 0; p < number_of_points; ++p) {
+                        auto& point = points[p];
+                        auto speedup = point.gnps / points[0].gnps;
+
+                        printf("    { \"threads\": %zu, \"gnps\": %.4f, \"speedup\": %.3f, \"efficiency\": %.3f }%s\n",
+                               point.threads, point.gnps, speedup, speedup / point.threads, p + 1 < number_of_points ? "," : "");
+                }
+
+                printf("  ]\n");
+                printf("}\n");
+        }
+
+        if (!ok) fprintf(stderr, "error: some bench positions gave wrong results.\n");
+        return ok;
+}
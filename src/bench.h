@@ -0,0 +1,52 @@
+#pragma once
+#include <stddef.h>
+#include "perft.h"
+
+//  Unit-testing structure containing an FEN, and the (maximum) depth, as well as a list of expected
+//  perft results at a given depth
+
+struct PerftTest {
+        char const* name;
+        char const* FEN;
+        Depth       depth;
+        Nodes       expected[7];
+};
+
+constexpr size_t NumberOfPerftTests = 7;
+extern const PerftTest PerftTests[NumberOfPerftTests];
+
+
+/*
+ *   The bench runs every test position a number of times, after some untimed warmup runs, and
+ *   reports the median, minimum and standard deviation of the times, either as a table or as JSON.
+ *
+ *   A JSON report of an earlier run can be given as a baseline. Each position is then compared with
+ *   it by Welch's t-test on the times of both runs, and flagged as a regression if it is slower with
+ *   a significance of 5%. This needs at least two repetitions in both runs, and as many as possible
+ *   to detect small changes, e.g.
+ *
+ *       ./perft --bench --repeat 10 --json > baseline.json
+ *       ./perft --bench --repeat 10 --compare baseline.json
+ */
+
+struct BenchOptions {
+        size_t      number_of_threads;
+        size_t      warmup;      // untimed runs of each position
+        size_t      repetitions; // timed runs of each position
+        bool        json;        // print a JSON report instead of a table
+        bool        counters;    // also print hardware performance counters (see counters.h)
+        char const* baseline;    // path of the JSON report to compare with, if any
+};
+
+// Returns false if any position gave a wrong result, or regressed from the baseline.
+bool bench(BenchOptions const& options);
+
+
+/*
+ *   The scaling mode runs the bench at increasing thread counts up to `number_of_threads`: all
+ *   powers of two, the cores of one package, all physical cores, and all hardware threads. It
+ *   reports the total speed, speedup and parallel efficiency at each count. Use `--affinity`, so
+ *   that threads fill the physical cores before their SMT siblings.
+ */
+
+bool scaling(BenchOptions const& options);
@@ -23,17 +23,17 @@ constexpr BitBoard Rank3BB = 0x0000'0000'00ff'0000;
 constexpr BitBoard Rank8BB = 0xff00'0000'0000'0000;
 
 
-inline BitBoard file_of(Square sq) { return FileABB << (sq &  7); }
-inline BitBoard rank_of(Square sq) { return Rank1BB << (sq & 56); }
+constexpr BitBoard file_of(Square sq) { return FileABB << (sq &  7); }
+constexpr BitBoard rank_of(Square sq) { return Rank1BB << (sq & 56); }
 
-inline BitBoard  north(BitBoard bb) { return bb << North; }
-inline BitBoard  south(BitBoard bb) { return bb >> North; }
-inline BitBoard   east(BitBoard bb) { return bb << East &~ FileABB; }
-inline BitBoard   west(BitBoard bb) { return bb >> East &~ FileHBB; }
-inline BitBoard rotate(BitBoard bb) { return __builtin_bswap64(bb); }
+constexpr BitBoard  north(BitBoard bb) { return bb << North; }
+constexpr BitBoard  south(BitBoard bb) { return bb >> North; }
+constexpr BitBoard   east(BitBoard bb) { return bb << East &~ FileABB; }
+constexpr BitBoard   west(BitBoard bb) { return bb >> East &~ FileHBB; }
+constexpr BitBoard rotate(BitBoard bb) { return __builtin_bswap64(bb); }
 
 
-inline unsigned popcount(BitBoard bb) {
+constexpr unsigned popcount(BitBoard bb) {
         return __builtin_popcountll(bb);
 }
 
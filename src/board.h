@@ -19,6 +19,9 @@
  *
  *   - There is an eighth piece type called a castle, which simply represents a
  *     rook that can be castled with. Upon moving, this type decays to a rook.
+ *
+ *   - When compiled with `-DPERFT_INCREMENTAL_KEY`, the board also carries a Zobrist
+ *     key (see zobrist.h) which is updated incrementally as moves are made.
  */
 
 typedef int PieceType;
@@ -38,6 +41,10 @@ struct Board {
         BitBoard x,y,z;
         BitBoard our;
 
+#ifdef PERFT_INCREMENTAL_KEY
+        uint64_t key;
+#endif
+
         BitBoard occupied()   const { return x | y | z; }
         BitBoard en_passant() const { return our & ~occupied(); }
 
@@ -53,6 +60,10 @@ struct Board {
                      & ((piece & 0b010) ? y : ~y)
                      & ((piece & 0b100) ? z : ~z);
         }
+
+        PieceType piece_on(Square sq) const {
+                return (x >> sq & 1) | (y >> sq & 1) << 1 | (z >> sq & 1) << 2;
+        }
 };
 
 
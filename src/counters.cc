@@ -0,0 +1,101 @@
+#include <dirent.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "counters.h"
+
+struct PerfCounterEvent {
+        uint32_t type;
+        uint64_t config;
+};
+
+constexpr uint64_t cache_miss_event(uint64_t cache) {
+        return cache | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+}
+
+// In the order of `PerfCounter`.
+constexpr PerfCounterEvent PerfCounterEvents[NumberOfPerfCounters] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HW_CACHE, cache_miss_event(PERF_COUNT_HW_CACHE_L1D) },
+        { PERF_TYPE_HW_CACHE, cache_miss_event(PERF_COUNT_HW_CACHE_LL) },
+        { PERF_TYPE_HW_CACHE, cache_miss_event(PERF_COUNT_HW_CACHE_DTLB) },
+};
+
+
+int open_perf_counter(PerfCounter counter, pid_t thread)
+{
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+
+        attr.size = sizeof(attr);
+        attr.type = PerfCounterEvents[counter].type;
+        attr.config = PerfCounterEvents[counter].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1; // also count the threads created from now on
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // The counters can't be read as a group when inherited, so each is opened on its own.
+        return syscall(SYS_perf_event_open, &attr, thread, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+
+bool open_perf_counters(PerfCounters& counters)
+{
+        counters.number_of_threads = 0;
+        bool any = false;
+
+        // Threads that already exist, such as a thread pool, don't inherit the counters of the caller.
+        auto tasks = opendir("/proc/self/task");
+        if (tasks == nullptr) return false;
+
+        while (auto entry = readdir(tasks)) {
+                if (entry->d_name[0] == '.' || counters.number_of_threads == MaximumCountedThreads) continue;
+
+                pid_t thread = atoi(entry->d_name);
+                auto fds = counters.fds[counters.number_of_threads++];
+
+                for (int counter = 0; counter < NumberOfPerfCounters; ++counter) {
+                        fds[counter] = open_perf_counter((PerfCounter) counter, thread);
+                        any |= fds[counter] >= 0;
+                }
+        }
+
+        closedir(tasks);
+        return any;
+}
+
+
+void close_perf_counters(PerfCounters& counters, double counts[NumberOfPerfCounters])
+{
+        for (int counter = 0; counter < NumberOfPerfCounters; ++counter) counts[counter] = -1.0;
+
+        for (size_t thread = 0; thread < counters.number_of_threads; ++thread) {
+                for (int counter = 0; counter < NumberOfPerfCounters; ++counter) {
+                        auto& fd = counters.fds[thread][counter];
+                        if (fd < 0) continue;
+
+                        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+                        struct { uint64_t value, time_enabled, time_running; } result;
+
+                        // Counters that never got a turn on the PMU, e.g. with too many counters, are unavailable.
+                        if (read(fd, &result, sizeof(result)) == sizeof(result) && result.time_running > 0) {
+                                if (counts[counter] < 0) counts[counter] = 0.0;
+                                counts[counter] += (double) result.value * result.time_enabled / result.time_running;
+                        }
+
+                        close(fd);
+                        fd = -1;
+                }
+        }
+
+        counters.number_of_threads = 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+/*
+ *   Hardware performance counters, opened with `perf_event_open` for every thread of the process,
+ *   such as the pool of `threaded_perft`, and for all threads they create afterwards. The counts of
+ *   the threads are summed.
+ *
+ *   Counters are often unavailable, e.g. in containers and VMs, or restricted by
+ *   /proc/sys/kernel/perf_event_paranoid, in which case they are simply left out. Only user space
+ *   events are counted. The generic events of the kernel have no L2 cache event, so L2 misses
+ *   aren't included.
+ */
+
+enum PerfCounter {
+        CyclesCounter,
+        InstructionsCounter,
+        BranchMissesCounter,
+        L1DMissesCounter,
+        LLCMissesCounter,
+        DTLBMissesCounter,
+        NumberOfPerfCounters,
+};
+
+constexpr size_t MaximumCountedThreads = 512;
+
+struct PerfCounters {
+        int    fds[MaximumCountedThreads][NumberOfPerfCounters]; // -1 if unavailable
+        size_t number_of_threads;
+};
+
+// Start counting, returns false if no counter at all is available.
+bool open_perf_counters(PerfCounters& counters);
+
+// Stop counting, and get the counts, scaled up if the counters were multiplexed. The counts of
+// unavailable counters are negative.
+void close_perf_counters(PerfCounters& counters, double counts[NumberOfPerfCounters]);
@@ -0,0 +1,410 @@
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bitboard.h"
+#include "board.h"
+#include "distributed.h"
+#include "fen.h"
+#include "movegen.h"
+#include "perft.h"
+#include "uci.h"
+
+/*
+ *   The protocol is line based text, one position at a time:
+ *
+ *       coordinator -> worker:  "perft <depth> <FEN>\n"
+ *       worker -> coordinator:  "<nodes>\n"
+ */
+
+constexpr size_t FrontierTarget = 4096; // enough positions to balance many workers of many threads
+constexpr size_t MaximumWorkers = 1024;
+constexpr size_t NoItem = SIZE_MAX;
+
+
+struct FrontierEntry {
+        Board board;
+        Nodes multiplicity;
+};
+
+struct Frontier {
+        FrontierEntry*  entries;
+        size_t          size;
+        size_t          capacity;
+
+        void push(FrontierEntry const& entry) {
+                if (size == capacity) {
+                        capacity = capacity ? 2 * capacity : 256;
+                        entries = (FrontierEntry*) realloc(entries, capacity * sizeof(FrontierEntry));
+                        assert(entries != nullptr && "frontier allocation failed!");
+                }
+
+                entries[size++] = entry;
+        }
+};
+
+
+int compare_entries(void const* a, void const* b)
+{
+        auto& p = ((FrontierEntry const*) a)->board;
+        auto& q = ((FrontierEntry const*) b)->board;
+
+        if (p.x   != q.x)   return p.x   < q.x   ? -1 : 1;
+        if (p.y   != q.y)   return p.y   < q.y   ? -1 : 1;
+        if (p.z   != q.z)   return p.z   < q.z   ? -1 : 1;
+        if (p.our != q.our) return p.our < q.our ? -1 : 1;
+        return 0;
+}
+
+
+// Expand every position of the frontier by one ply, merging transpositions into a single entry.
+void expand_frontier(Frontier const& frontier, Frontier& next)
+{
+        for (size_t i = 0; i < frontier.size; ++i) {
+                auto& entry = frontier.entries[i];
+                visit_children(entry.board, [&](Board const& child) { next.push({ child, entry.multiplicity }); });
+        }
+
+        if (next.size == 0) return;
+
+        qsort(next.entries, next.size, sizeof(FrontierEntry), compare_entries);
+        size_t unique = 0;
+
+        for (size_t i = 1; i < next.size; ++i) {
+                if (compare_entries(&next.entries[unique], &next.entries[i]) == 0) {
+                        next.entries[unique].multiplicity += next.entries[i].multiplicity;
+                }
+
+                else next.entries[++unique] = next.entries[i];
+        }
+
+        next.size = unique + 1;
+}
+
+
+// Open a listening socket, or connect to one, returning the file descriptor or -1 on failure.
+int open_socket(char const* address, bool listening)
+{
+        if (strncmp(address, "unix:", 5) == 0) {
+                sockaddr_un local = { .sun_family = AF_UNIX };
+                auto path = address + 5;
+
+                if (strlen(path) >= sizeof(local.sun_path)) {
+                        fprintf(stderr, "error: socket path too long.\n");
+                        return -1;
+                }
+
+                strcpy(local.sun_path, path);
+
+                int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd < 0) return -1;
+
+                if (listening) {
+                        unlink(path);
+
+                        if (bind(fd, (sockaddr*) &local, sizeof(local)) == 0 && listen(fd, 64) == 0) return fd;
+                }
+
+                else if (connect(fd, (sockaddr*) &local, sizeof(local)) == 0) return fd;
+
+                fprintf(stderr, "error: %s: %s.\n", address, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        // Otherwise "host:port", where the host may be empty to listen on all interfaces.
+        auto colon = strrchr(address, ':');
+
+        if (colon == nullptr) {
+                fprintf(stderr, "error: invalid address %s, expected host:port or unix:<path>.\n", address);
+                return -1;
+        }
+
+        char host[256];
+        size_t host_length = colon - address;
+
+        if (host_length >= sizeof(host)) {
+                fprintf(stderr, "error: host name too long.\n");
+                return -1;
+        }
+
+        memcpy(host, address, host_length);
+        host[host_length] = '\0';
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+        addrinfo* addresses;
+        int error = getaddrinfo(host_length ? host : nullptr, colon + 1, &hints, &addresses);
+
+        if (error) {
+                fprintf(stderr, "error: %s: %s.\n", address, gai_strerror(error));
+                return -1;
+        }
+
+        int fd = -1;
+
+        for (auto info = addresses; info; info = info->ai_next) {
+                fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+                if (fd < 0) continue;
+
+                if (listening) {
+                        int yes = 1;
+                        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+                        if (bind(fd, info->ai_addr, info->ai_addrlen) == 0 && listen(fd, 64) == 0) break;
+                }
+
+                else if (connect(fd, info->ai_addr, info->ai_addrlen) == 0) break;
+
+                close(fd);
+                fd = -1;
+        }
+
+        if (fd < 0) fprintf(stderr, "error: %s: %s.\n", address, strerror(errno));
+
+        freeaddrinfo(addresses);
+        return fd;
+}
+
+
+struct Connection {
+        int     fd;
+        size_t  item;   // index of the frontier entry being counted, or `NoItem` if idle
+        size_t  length; // of the partial reply in the buffer
+        char    buffer[32];
+};
+
+
+bool run_coordinator(char const* address, Board const& board, bool white_to_move, Depth depth, Nodes& nodes)
+{
+        if (depth == 0) {
+                nodes = 1; // definition of perft 0
+                return true;
+        }
+
+        // Listen before expanding the frontier, so that workers can already connect.
+        int listener = open_socket(address, true);
+        if (listener < 0) return false;
+
+        // Expand the frontier until it is big enough (see `expand_to_target`), always leaving at least
+        // one ply to count.
+        Frontier frontier = {};
+        frontier.push({ board, 1 });
+
+        expand_to_target(frontier.size, FrontierTarget, [&](size_t& size) {
+                if (depth <= 1) return false;
+
+                Frontier next = {};
+                expand_frontier(frontier, next);
+
+                free(frontier.entries);
+                frontier = next;
+                size = frontier.size;
+
+                depth -= 1;
+                white_to_move = !white_to_move;
+
+                return true;
+        });
+
+        nodes = 0;
+
+        // A write to a lost worker should fail, instead of killing the coordinator.
+        signal(SIGPIPE, SIG_IGN);
+
+        printf("Distributing %zu positions at depth %u, waiting for workers on %s.\n\n", frontier.size, depth, address);
+        fflush(stdout);
+
+        // Positions waiting to be counted, as a stack, initially in frontier order.
+        auto queue = new size_t[frontier.size];
+        size_t queued = frontier.size;
+
+        for (size_t i = 0; i < frontier.size; ++i) queue[i] = frontier.size - 1 - i;
+
+        Connection connections[MaximumWorkers];
+        size_t number_of_connections = 0;
+        size_t finished = 0;
+
+        pollfd fds[MaximumWorkers + 1];
+
+        auto lose_connection = [&](size_t i) {
+                auto& connection = connections[i];
+
+                if (connection.item != NoItem) {
+                        queue[queued++] = connection.item;
+                        printf("worker %d lost, re-issuing its position.\n", connection.fd);
+                }
+
+                else printf("worker %d disconnected.\n", connection.fd);
+
+                fflush(stdout);
+                close(connection.fd);
+                connections[i] = connections[--number_of_connections];
+        };
+
+        while (finished < frontier.size) {
+                // Hand out positions to idle workers.
+                for (size_t i = 0; i < number_of_connections && queued > 0; ++i) {
+                        auto& connection = connections[i];
+                        if (connection.item != NoItem) continue;
+
+                        connection.item = queue[--queued];
+                        auto& entry = frontier.entries[connection.item];
+
+                        char fen[FENMaximumLength];
+                        format_fen(entry.board, white_to_move, fen);
+
+                        if (dprintf(connection.fd, "perft %u %s\n", depth, fen) < 0) lose_connection(i--);
+                }
+
+                fds[0] = { .fd = listener, .events = POLLIN, .revents = 0 };
+
+                for (size_t i = 0; i < number_of_connections; ++i) {
+                        fds[i + 1] = { .fd = connections[i].fd, .events = POLLIN, .revents = 0 };
+                }
+
+                if (poll(fds, number_of_connections + 1, -1) < 0) {
+                        if (errno == EINTR) continue;
+
+                        fprintf(stderr, "error: poll: %s.\n", strerror(errno));
+                        break;
+                }
+
+                // Go backwards, as losing a connection moves the last one into its place.
+                for (size_t i = number_of_connections; i --> 0;) {
+                        if (!fds[i + 1].revents) continue;
+
+                        auto& connection = connections[i];
+                        auto space = sizeof(connection.buffer) - connection.length - 1;
+                        auto n = read(connection.fd, connection.buffer + connection.length, space);
+
+                        if (n <= 0) {
+                                lose_connection(i);
+                                continue;
+                        }
+
+                        connection.length += n;
+                        connection.buffer[connection.length] = '\0';
+
+                        auto newline = strchr(connection.buffer, '\n');
+
+                        if (newline == nullptr) {
+                                // A reply never needs the whole buffer.
+                                if (connection.length == sizeof(connection.buffer) - 1) lose_connection(i);
+                                continue;
+                        }
+
+                        char* end;
+                        auto count = strtoull(connection.buffer, &end, 10);
+
+                        if (end != newline || connection.item == NoItem || newline[1] != '\0') {
+                                fprintf(stderr, "error: invalid reply from worker %d.\n", connection.fd);
+                                lose_connection(i);
+                                continue;
+                        }
+
+                        nodes += count * frontier.entries[connection.item].multiplicity;
+                        finished += 1;
+
+                        connection.item = NoItem;
+                        connection.length = 0;
+                }
+
+                if (fds[0].revents & POLLIN) {
+                        int fd = accept(listener, nullptr, nullptr);
+                        if (fd < 0) continue;
+
+                        if (number_of_connections == MaximumWorkers) {
+                                close(fd);
+                                continue;
+                        }
+
+                        connections[number_of_connections++] = { .fd = fd, .item = NoItem, .length = 0, .buffer = {} };
+
+                        printf("worker %d connected.\n", fd);
+                        fflush(stdout);
+                }
+        }
+
+        // Closing the connections tells the workers to exit.
+        for (size_t i = 0; i < number_of_connections; ++i) close(connections[i].fd);
+
+        close(listener);
+        if (strncmp(address, "unix:", 5) == 0) unlink(address + 5);
+
+        delete[] queue;
+        free(frontier.entries);
+
+        printf("\n");
+        return finished == frontier.size;
+}
+
+
+bool run_worker(char const* address, size_t number_of_threads)
+{
+        int fd = open_socket(address, false);
+        if (fd < 0) return false;
+
+        signal(SIGPIPE, SIG_IGN);
+
+        FILE* input = fdopen(dup(fd), "r");
+        assert(input != nullptr);
+
+        printf("Connected to %s, counting on %zu threads.\n\n", address, number_of_threads);
+        fflush(stdout);
+
+        char* line = nullptr;
+        size_t line_size = 0;
+        bool ok = true;
+
+        // Count positions until the coordinator closes the connection.
+        while (getline(&line, &line_size, input) != -1) {
+                unsigned depth;
+                int offset;
+
+                if (sscanf(line, "perft %u %n", &depth, &offset) != 1) {
+                        fprintf(stderr, "error: invalid request from coordinator.\n");
+                        ok = false;
+                        break;
+                }
+
+                Board board;
+                FENInfo info;
+
+                auto error = parse_fen(line + offset, board, info);
+
+                if (error != FENOk) {
+                        fprintf(stderr, "error: invalid fen from coordinator: %s.\n", FENErrorMessages[error]);
+                        ok = false;
+                        break;
+                }
+
+                auto t1 = get_time_from_os();
+                auto nodes = depth ? threaded_perft(board, depth, number_of_threads) : 1;
+                auto t2 = get_time_from_os();
+
+                if (dprintf(fd, "%lu\n", nodes) < 0) break;
+
+                line[strcspn(line, "\n")] = '\0';
+                printf("%12lu nodes  (%6.3f Gnps)  %s\n", nodes, nodes / (t2 - t1) / 1.0e9, line);
+                fflush(stdout);
+        }
+
+        free(line);
+        fclose(input);
+        close(fd);
+
+        return ok;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stddef.h>
+#include "board.h"
+#include "perft.h"
+
+/*
+ *   Distributed perft. The coordinator expands the tree to a frontier of unique positions, each
+ *   with the number of paths leading to it (its multiplicity), and hands them out one at a time to
+ *   worker processes, which count them with `threaded_perft` on all of their own threads. The
+ *   result is the sum of the counts weighted by multiplicity.
+ *
+ *   Workers may come and go during a run. A worker is considered lost when its connection closes,
+ *   and its position is then handed to the next free worker.
+ *
+ *   Addresses are either "host:port" for TCP, or "unix:<path>" for a Unix domain socket, e.g.
+ *
+ *       ./perft --coordinator unix:/tmp/perft.sock <FEN> 8
+ *       ./perft --worker unix:/tmp/perft.sock
+ */
+
+bool run_coordinator(char const* address, Board const& board, bool white_to_move, Depth depth, Nodes& nodes);
+bool run_worker(char const* address, size_t number_of_threads);
+
+// Open a listening socket on an address as above, or connect to one. Returns the file descriptor,
+// or -1 on failure.
+int open_socket(char const* address, bool listening);
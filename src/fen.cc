@@ -1,135 +1,524 @@
-// FIXME: this is so much of an abomination it is in its own separate source file with
-// no header...
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "bitboard.h"
+#include "board.h"
+#include "fen.h"
+#include "magic.h"
+#include "movegen.h"
+#include "zobrist.h"
+
+// In the order of `FENError`.
+char const* const FENErrorMessages[NumberOfFENErrors] = {
+        "ok",
+        "missing field",
+        "invalid piece",
+        "rank without 8 squares",
+        "board without 8 ranks",
+        "each side needs exactly one king",
+        "pawns on the first or last rank",
+        "invalid side to move",
+        "invalid castling rights, or their king or rook is missing",
+        "invalid en-passant square, or no pawn just made a double push past it",
+        "the side not to move is in check",
+        "invalid halfmove clock",
+        "invalid fullmove number",
+};
+
+
+/*
+ *   Splitting a line into fields. Each window of 64 bytes is classified by vector compares into a
+ *   mask of separators and a mask of newlines, from which the starts and ends of all fields in the
+ *   window follow with a few bitwise operations. A typical FEN fits in a single window, so its
+ *   fields are found without a loop over its characters.
+ */
+
+// The four position fields, the two move counters, and the start of any operations after them.
+constexpr size_t MaximumFENFields = 7;
+
+struct FENFields {
+        char const* begin[MaximumFENFields];
+        char const* end[MaximumFENFields];
+        size_t      size;
+        char const* text_end; // end of the last field of the line
+        char const* line_end; // the newline, or the end of the input
+};
+
+struct ByteMasks {
+        uint64_t separators; // spaces, tabs, and the carriage returns of CRLF line ends
+        uint64_t newlines;
+};
+
+
+inline ByteMasks classify_bytes(char const* p)
+{
+#if defined(__AVX512BW__)
+        auto bytes = _mm512_loadu_si512(p);
+        auto match = [&](char c) -> uint64_t { return _mm512_cmpeq_epi8_mask(bytes, _mm512_set1_epi8(c)); };
 
-// FIXME: this file is in need of improvement... this should later be integrated into some
-// actual parsing within a UCI interface. This was just a quick'n'dirty function to do some
-// perft testing during development
+        return { match(' ') | match('\t') | match('\r'), match('\n') };
+
+#elif defined(__AVX2__)
+        ByteMasks masks = { 0, 0 };
+
+        for (int i = 0; i < 2; ++i) {
+                auto bytes = _mm256_loadu_si256((__m256i const*) (p + 32*i));
+                auto match = [&](char c) -> uint64_t {
+                        return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(c)));
+                };
+
+                masks.separators |= (match(' ') | match('\t') | match('\r')) << 32*i;
+                masks.newlines   |= match('\n') << 32*i;
+        }
+
+        return masks;
+
+#else
+        ByteMasks masks = { 0, 0 };
+
+        for (int i = 0; i < 4; ++i) {
+                auto bytes = _mm_loadu_si128((__m128i const*) (p + 16*i));
+                auto match = [&](char c) -> uint64_t {
+                        return (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+                };
+
+                masks.separators |= (match(' ') | match('\t') | match('\r')) << 16*i;
+                masks.newlines   |= match('\n') << 16*i;
+        }
+
+        return masks;
+#endif
+}
+
+
+// The same for the last, partial window of the input, where the end of the input acts as a newline.
+inline ByteMasks classify_tail(char const* p, char const* end)
+{
+        ByteMasks masks = { 0, 0 };
+        size_t size = end - p;
+
+        for (size_t i = 0; i < size; ++i) {
+                masks.separators |= (uint64_t) (p[i] == ' ' || p[i] == '\t' || p[i] == '\r') << i;
+                masks.newlines   |= (uint64_t) (p[i] == '\n') << i;
+        }
+
+        masks.newlines |= OneBB << size;
+        return masks;
+}
+
+
+void split_fields(char const* begin, char const* end, FENFields& fields)
+{
+        fields.size = 0;
+        fields.text_end = begin;
+
+        size_t number_of_ends = 0;
+        uint64_t carry = 0; // whether the previous window ended inside a field
+
+        for (auto window = begin;; window += 64) {
+                auto masks = (end - window >= 64) ? classify_bytes(window) : classify_tail(window, end);
+
+                auto newline = masks.newlines & -masks.newlines;
+                auto line = newline ? newline - 1 : ~(uint64_t) 0; // the bytes before the end of the line
+                auto text = ~masks.separators & line;
+                auto previous = text << 1 | carry;
+
+                auto starts = text & ~previous;
+                auto ends = ~text & previous;
+                carry = text >> 63;
+
+                if (ends) fields.text_end = window + 63 - __builtin_clzll(ends);
+
+                for (; starts && fields.size < MaximumFENFields; starts &= starts - 1) {
+                        fields.begin[fields.size++] = window + trailing_zeros(starts);
+                }
+
+                for (; ends && number_of_ends < MaximumFENFields; ends &= ends - 1) {
+                        fields.end[number_of_ends++] = window + trailing_zeros(ends);
+                }
+
+                if (newline) {
+                        fields.line_end = window + trailing_zeros(newline);
+                        return;
+                }
+        }
+}
+
+
+/*
+ *   Parsing of the fields.
+ */
+
+constexpr uint16_t WhitePiece    = 0x0008;
+constexpr uint16_t RankSeparator = 0x0010;
+constexpr unsigned SquaresShift  = 8; // of the number of squares a symbol stands for
+
+// What each character of the piece placement stands for, zero if it is invalid.
+struct FENSymbolTable {
+        uint16_t symbols[256];
+
+        constexpr FENSymbolTable() : symbols {} {
+                for (PieceType piece = Pawn; piece <= King; ++piece) {
+                        if (piece == Castle) continue;
+
+                        auto c = ".pnbr.qk"[piece];
+                        symbols[(uint8_t) c] = piece | 1 << SquaresShift;
+                        symbols[(uint8_t) c - 0x20] = piece | WhitePiece | 1 << SquaresShift; // uppercase
+                }
+
+                for (int n = 1; n <= 8; ++n) symbols['0' + n] = n << SquaresShift;
+                symbols['/'] = RankSeparator;
+        }
+};
+
+constexpr FENSymbolTable FENSymbols;
 
-#pragma once
-#include "board.h"
 
-// Parse Forsyth-Edwards Notation for a legal chess position.
-//   (Reference: https://www.chessprogramming.org/Forsyth-Edwards_Notation)
+struct CastlingRight {
+        char     symbol;
+        Square   king, rook;
+        bool     white;
+};
 
-#define ERROR()  do { *ok = false; return board; } while(0)
+constexpr CastlingRight CastlingRights[] = {
+        { 'K', E1, H1, true },
+        { 'Q', E1, A1, true },
+        { 'k', E1 ^ 56, H8, false },
+        { 'q', E1 ^ 56, A8, false },
+};
 
 
-struct Board parse_fen(const char *fen_string, bool *white_to_move, bool *ok)
+// The squares whose bytes have the given bit set.
+inline BitBoard gather_bit(uint8_t const squares[64], int bit)
 {
-        PieceType piece_lookup[128];
-        piece_lookup['p'] = Pawn;
-        piece_lookup['n'] = Knight;
-        piece_lookup['b'] = Bishop;
-        piece_lookup['r'] = Rook;
-        piece_lookup['q'] = Queen;
-        piece_lookup['k'] = King;
-
-        struct Board board = {};
-        Square sq = 56, file = 0;
-
-	/* Parse board */
-	while (sq != 8 || file != 8)
-	{
-		const char c = *fen_string++;
-		const char lower_mask = 0x20;
-
-		if (file > 8) ERROR();
-
-		/* end of rank */
-		if (file == 8) {
-			if (c != '/') ERROR();
-                        sq += 2*South, file = 0;
-			continue;
-		}
-
-		/* blank squares */
-		if ('1' <= c && c <= '8') {
-                        Square offset =	c - '0';
-			sq += offset, file += offset;
-		}
-
-		else {
-                        PieceType piece = piece_lookup[c | lower_mask];
-                        if (piece == Empty) ERROR();
-                        auto mask = OneBB << sq;
-
-                        if (piece & 0b001) board.x |= mask;
-                        if (piece & 0b010) board.y |= mask;
-                        if (piece & 0b100) board.z |= mask;
-
-                        /* Check if piece is black */
-                        if (!(c & lower_mask)) board.our |= mask;
-
-			sq += 1, file += 1;
-		}
-	}
-
-	/* space separator */
-	if (*fen_string++ != ' ') ERROR();
-
-	/* parse side-to-move */
-	switch (*fen_string++) {
-		case 'w': *white_to_move = true; break;
-		case 'b': *white_to_move = false; break;
-		default : ERROR();
-	}
-
-	/* space separator */
-	if (*fen_string++ != ' ') ERROR();
-
-	if (*fen_string == '-')
-		fen_string += 1;
-
-	else while (*fen_string != ' ') {
-                BitBoard castling_mask = 0;
-
-		switch (*fen_string++) {
-			case 'K': castling_mask |= OneBB << H1; break;
-			case 'Q': castling_mask |= OneBB << A1; break;
-			case 'k': castling_mask |= OneBB << H8; break;
-			case 'q': castling_mask |= OneBB << A8; break;
-			default : ERROR();
-		}
-
-		/* flip rooks to castles */
-		board.x ^= castling_mask;
-	}
-
-	/* space separator */
-	if (*fen_string++ != ' ') ERROR();
-
-	/* parse en-passant */
-        BitBoard en_passant_mask = 0;
-
-	if (*fen_string != '-') {
-                Square file = *fen_string++ - 'a';
-                Square rank = *fen_string++ - '1';
-
-		if (file >= 8 || rank >= 8) ERROR();
-
-                Square en_passant = (rank << 3) + file;
-		en_passant_mask = OneBB << en_passant;
-	}
-
-	/* There is more FEN info after this point such as movenumber and 50 move clock but we don't
-	 * care about this information yet. TODO: handle this information
-	 */
-
-	/* Rotate bitboards if black is the side to move */
-	if (*white_to_move)
-                board.our |= en_passant_mask;
-
-	else {
+#if defined(__AVX512BW__)
+        return _mm512_test_epi8_mask(_mm512_loadu_si512(squares), _mm512_set1_epi8(1 << bit));
+
+#elif defined(__AVX2__)
+        BitBoard bb = 0;
+
+        for (int i = 0; i < 2; ++i) {
+                auto bytes = _mm256_loadu_si256((__m256i const*) (squares + 32*i));
+                bb |= (BitBoard) (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi16(bytes, 7 - bit)) << 32*i;
+        }
+
+        return bb;
+
+#else
+        BitBoard bb = 0;
+
+        for (int i = 0; i < 4; ++i) {
+                auto bytes = _mm_loadu_si128((__m128i const*) (squares + 16*i));
+                bb |= (BitBoard) (uint16_t) _mm_movemask_epi8(_mm_slli_epi16(bytes, 7 - bit)) << 16*i;
+        }
+
+        return bb;
+#endif
+}
+
+
+// Fills in the pieces of `board`, with `our` holding the white pieces. The mix of pieces and empty
+// squares is too irregular for branches to be predicted, so each symbol is stored in a mailbox
+// without any, and the errors are only checked at the end. The bitboards are then gathered from
+// the mailbox with vector instructions.
+FENError parse_placement(char const* p, char const* end, Board& board)
+{
+        alignas(64) uint8_t squares[64] = {};
+
+        unsigned index = 0; // of the next square, from a8 to h1 in the order of the FEN
+        unsigned ranks = 1;
+        bool bad_piece = false, bad_rank = false;
+
+        for (; p < end; ++p) {
+                auto symbol = FENSymbols.symbols[(uint8_t) *p];
+                bool separator = symbol & RankSeparator;
+
+                // Empty squares and separators store zero on a square that is empty, or not yet filled.
+                squares[(index ^ 56) & 63] = symbol & 0x0f;
+
+                // Every rank must be complete before the next starts, which also catches ranks that
+                // overflowed, as the index only grows.
+                bad_piece |= symbol == 0;
+                bad_rank |= separator & (index != 8*ranks);
+                ranks += separator;
+                index += symbol >> SquaresShift;
+        }
+
+        if (bad_piece) return FENBadPiece;
+        if (bad_rank || index != 8*ranks) return FENBadRank;
+        if (ranks != 8) return FENBadNumberOfRanks;
+
+        board.x   = gather_bit(squares, 0);
+        board.y   = gather_bit(squares, 1);
+        board.z   = gather_bit(squares, 2);
+        board.our = gather_bit(squares, 3);
+
+        auto kings = board.extract_by_piece(King);
+        if (popcount(kings & board.our) != 1 || popcount(kings &~ board.our) != 1) return FENBadKings;
+
+        if (board.extract_by_piece(Pawn) & (Rank1BB | Rank8BB)) return FENBadPawns;
+
+        return FENOk;
+}
+
+
+// Turns the rooks with castling rights into castles.
+FENError parse_castling(char const* p, char const* end, Board& board)
+{
+        if (end - p == 1 && *p == '-') return FENOk;
+
+        auto white = board.our;
+        auto black = board.occupied() &~ board.our;
+
+        BitBoard castles = 0;
+
+        for (; p < end; ++p) {
+                CastlingRight const* right = nullptr;
+
+                for (auto& candidate : CastlingRights) {
+                        if (candidate.symbol == *p) right = &candidate;
+                }
+
+                if (right == nullptr) return FENBadCastling;
+
+                auto mask = OneBB << right->rook;
+                auto ours = right->white ? white : black;
+
+                if (castles & mask) return FENBadCastling; // given twice
+                if (board.piece_on(right->king) != King || !(ours >> right->king & 1)) return FENBadCastling;
+                if (board.piece_on(right->rook) != Rook || !(ours >> right->rook & 1)) return FENBadCastling;
+
+                castles |= mask;
+        }
+
+        board.x ^= castles;
+        return FENOk;
+}
+
+
+FENError parse_en_passant(char const* p, char const* end, Board const& board, bool white_to_move, BitBoard& en_passant)
+{
+        en_passant = 0;
+
+        if (end - p == 1 && *p == '-') return FENOk;
+        if (end - p != 2) return FENBadEnPassant;
+
+        unsigned file = p[0] - 'a';
+        if (file >= 8 || p[1] != (white_to_move ? '6' : '3')) return FENBadEnPassant;
+
+        // The enemy pawn must be in front of the square, and have come from behind it.
+        Square sq = (white_to_move ? 40 : 16) + file;
+        Square pawn = white_to_move ? sq + South : sq + North;
+        Square start = white_to_move ? sq + North : sq + South;
+
+        auto enemy = white_to_move ? board.occupied() &~ board.our : board.our;
+
+        if (board.piece_on(pawn) != Pawn || !(enemy >> pawn & 1)) return FENBadEnPassant;
+        if (board.occupied() >> sq & 1 || board.occupied() >> start & 1) return FENBadEnPassant;
+
+        en_passant = OneBB << sq;
+        return FENOk;
+}
+
+
+bool parse_number(char const* p, char const* end, unsigned& value)
+{
+        if (end - p > 6) return false;
+        value = 0;
+
+        for (; p < end; ++p) {
+                if (*p < '0' || *p > '9') return false;
+                value = 10*value + (*p - '0');
+        }
+
+        return true;
+}
+
+
+// Whether the side not to move is in check, given the board with white as `our` side. The checks
+// are generated from the point of view of the side not to move, with the magic backend as the
+// selected one may not be known yet, e.g. when the library parses a position before any run.
+bool opponent_in_check(Board const& board, bool white_to_move)
+{
+        auto opponent = board;
+
+        if (white_to_move) {
+                opponent.x = rotate(board.x);
+                opponent.y = rotate(board.y);
+                opponent.z = rotate(board.z);
+                opponent.our = rotate(board.occupied() &~ board.our);
+        }
+
+        MoveGenerationInfo info;
+        return generate_movegen_info<MagicSliders>(opponent, info) != EmptyBB;
+}
+
+
+FENError parse_fields(FENFields const& fields, Board& board, FENInfo& info)
+{
+        board = {};
+
+        if (fields.size < 4) return FENMissingField;
+
+        auto error = parse_placement(fields.begin[0], fields.end[0], board);
+        if (error != FENOk) return error;
+
+        if (fields.end[1] - fields.begin[1] != 1) return FENBadSideToMove;
+
+        switch (*fields.begin[1]) {
+                case 'w': info.white_to_move = true; break;
+                case 'b': info.white_to_move = false; break;
+                default : return FENBadSideToMove;
+        }
+
+        error = parse_castling(fields.begin[2], fields.end[2], board);
+        if (error != FENOk) return error;
+
+        BitBoard en_passant;
+        error = parse_en_passant(fields.begin[3], fields.end[3], board, info.white_to_move, en_passant);
+        if (error != FENOk) return error;
+
+        if (opponent_in_check(board, info.white_to_move)) return FENOpponentInCheck;
+
+        // The move counters are left out in EPD, where operations follow the position instead.
+        info.halfmove_clock = 0;
+        info.fullmove_number = 1;
+        size_t operations = 4;
+
+        if (fields.size > 4 && '0' <= *fields.begin[4] && *fields.begin[4] <= '9') {
+                if (!parse_number(fields.begin[4], fields.end[4], info.halfmove_clock)) return FENBadHalfmoveClock;
+
+                if (fields.size < 6 || !parse_number(fields.begin[5], fields.end[5], info.fullmove_number)) {
+                        return FENBadFullmoveNumber;
+                }
+
+                operations = 6;
+        }
+
+        info.fen = fields.begin[0];
+        info.fen_length = fields.end[3] - fields.begin[0];
+        info.operations = operations < fields.size ? fields.begin[operations] : fields.text_end;
+        info.operations_length = fields.text_end - info.operations;
+
+        // Rotate bitboards if black is the side to move.
+        if (info.white_to_move) {
+                board.our |= en_passant;
+        }
+
+        else {
                 BitBoard black = board.occupied() &~ board.our;
 
                 board.x = rotate(board.x);
                 board.y = rotate(board.y);
                 board.z = rotate(board.z);
-                board.our = rotate(black | en_passant_mask);
-	}
+                board.our = rotate(black | en_passant);
+        }
+
+#ifdef PERFT_INCREMENTAL_KEY
+        board.key = compute_key(board);
+#endif
+
+        return FENOk;
+}
+
+
+FENError parse_fen(char const* begin, char const* end, Board& board, FENInfo& info)
+{
+        FENFields fields;
+        split_fields(begin, end, fields);
+
+        info.line_number = 0;
+        return parse_fields(fields, board, info);
+}
+
 
-	*ok = true;
-	return board;
+FENError parse_fen(char const* fen, Board& board, FENInfo& info)
+{
+        return parse_fen(fen, fen + strlen(fen), board, info);
 }
 
-#undef ERROR
+
+/*
+ *   Bulk reading.
+ */
+
+bool open_fen_file(char const* path, FENReader& reader)
+{
+        reader = { .data = nullptr, .size = 0, .cursor = nullptr, .line_number = 0, .error = FENOk };
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat status;
+
+        if (fd < 0 || fstat(fd, &status) < 0) {
+                fprintf(stderr, "error: could not open %s.\n", path);
+                if (fd >= 0) close(fd);
+                return false;
+        }
+
+        // An empty file can't be mapped, but needs no data either.
+        if (status.st_size > 0) {
+                auto data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                if (data == MAP_FAILED) {
+                        fprintf(stderr, "error: could not map %s.\n", path);
+                        close(fd);
+                        return false;
+                }
+
+                madvise(data, status.st_size, MADV_SEQUENTIAL);
+
+                reader.data = (char const*) data;
+                reader.size = status.st_size;
+        }
+
+        close(fd);
+
+        reader.cursor = reader.data;
+        return true;
+}
+
+
+void close_fen_file(FENReader& reader)
+{
+        if (reader.data) munmap((void*) reader.data, reader.size);
+        reader.data = reader.cursor = nullptr;
+        reader.size = 0;
+}
+
+
+size_t read_fens(FENReader& reader, Board boards[], FENInfo infos[], size_t capacity)
+{
+        auto end = reader.data + reader.size;
+        size_t count = 0;
+
+        reader.error = FENOk;
+
+        while (count < capacity && reader.cursor < end) {
+                FENFields fields;
+                split_fields(reader.cursor, end, fields);
+
+                reader.line_number += 1;
+                reader.cursor = (fields.line_end < end) ? fields.line_end + 1 : end;
+
+                // Skip blank lines and comments.
+                if (fields.size == 0 || *fields.begin[0] == '#') continue;
+
+                FENInfo info;
+                reader.error = parse_fields(fields, boards[count], info);
+
+                if (reader.error != FENOk) break;
+
+                info.line_number = reader.line_number;
+                if (infos) infos[count] = info;
+
+                count += 1;
+        }
+
+        return count;
+}
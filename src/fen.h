@@ -0,0 +1,81 @@
+#pragma once
+#include <stddef.h>
+#include "board.h"
+
+/*
+ *   Parsing of Forsyth-Edwards Notation, and of EPD, which is the same but for the move counters,
+ *   followed by operations such as the ";D1 20" results of perft suites.
+ *   (Reference: https://www.chessprogramming.org/Forsyth-Edwards_Notation)
+ *
+ *   A position is parsed from a range of characters rather than a NUL-terminated string, up to the
+ *   end of its line, so that files can be parsed in place. The fields are split with vector compares
+ *   of 64 bytes at a time, which find all spaces and the end of the line of a typical FEN at once.
+ *
+ *   Positions are validated as far as the board representation relies on it: both sides have
+ *   exactly one king, no pawns are on the first or last rank, castling rights have their king and
+ *   rook in place, the en-passant square is behind a pawn that just made a double push, and the side
+ *   not to move isn't in check, as its king could then be captured.
+ */
+
+enum FENError {
+        FENOk,
+        FENMissingField,
+        FENBadPiece,
+        FENBadRank,
+        FENBadNumberOfRanks,
+        FENBadKings,
+        FENBadPawns,
+        FENBadSideToMove,
+        FENBadCastling,
+        FENBadEnPassant,
+        FENOpponentInCheck,
+        FENBadHalfmoveClock,
+        FENBadFullmoveNumber,
+        NumberOfFENErrors,
+};
+
+extern char const* const FENErrorMessages[NumberOfFENErrors];
+
+
+// Everything but the board. The text of the position and operations points into the parsed input.
+struct FENInfo {
+        bool        white_to_move;
+        unsigned    halfmove_clock;  // 0 if not given, as in EPD
+        unsigned    fullmove_number; // 1 if not given
+        size_t      line_number;     // only set by `read_fens`
+
+        char const* fen;             // the position fields, without counters or operations
+        size_t      fen_length;
+        char const* operations;      // anything after the position, e.g. EPD operations
+        size_t      operations_length;
+};
+
+// Parse the position on the first line of [begin, end).
+FENError parse_fen(char const* begin, char const* end, Board& board, FENInfo& info);
+
+// Parse a NUL-terminated position.
+FENError parse_fen(char const* fen, Board& board, FENInfo& info);
+
+
+/*
+ *   Bulk reading of a file of positions, one per line, which is mapped into memory rather than
+ *   copied. Blank lines and lines starting with '#' are skipped.
+ */
+
+struct FENReader {
+        char const* data;        // the mapped file
+        size_t      size;
+        char const* cursor;      // start of the next line
+        size_t      line_number; // of the last line read
+        FENError    error;       // of the last line, if `read_fens` stopped at an invalid one
+
+        bool at_end() const { return cursor == data + size; }
+};
+
+bool open_fen_file(char const* path, FENReader& reader);
+void close_fen_file(FENReader& reader);
+
+// Parse up to `capacity` positions into `boards`, and `infos` unless null. Returns the number parsed,
+// which is less than `capacity` at the end of the file, or if an invalid line was found, in which
+// case its error and line number are left in the reader. The next call continues after it.
+size_t read_fens(FENReader& reader, Board boards[], FENInfo infos[], size_t capacity);
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+TranspositionTable TT;
+[[gnu::tls_model("initial-exec")]] thread_local TTStats ThreadTTStats;
+
+
+// Allocate a table of (at most) the given size in MiB, rounded down to a power of two number of
+// buckets. A size of zero disables the table.
+
+bool resize_tt(size_t megabytes)
+{
+        free(TT.buckets);
+        TT.buckets = nullptr;
+        TT.bucket_mask = 0;
+
+        if (megabytes == 0) return true;
+
+        size_t bucket_count = 1;
+        while (bucket_count * 2 * sizeof(TTBucket) <= megabytes << 20) bucket_count *= 2;
+
+        TT.buckets = (TTBucket*) aligned_alloc(alignof(TTBucket), bucket_count * sizeof(TTBucket));
+        if (TT.buckets == nullptr) return false;
+
+        TT.bucket_mask = bucket_count - 1;
+        clear_tt();
+
+        return true;
+}
+
+
+void clear_tt()
+{
+        if (TT.enabled()) memset((void*) TT.buckets, 0, (TT.bucket_mask + 1) * sizeof(TTBucket));
+
+        TT.probes = 0;
+        TT.hits = 0;
+        TT.stores = 0;
+        TT.collisions = 0;
+}
+
+
+void flush_tt_stats()
+{
+        auto& stats = ThreadTTStats;
+
+        TT.probes     += stats.probes;
+        TT.hits       += stats.hits;
+        TT.stores     += stats.stores;
+        TT.collisions += stats.collisions;
+
+        stats = {};
+}
+
+
+void print_tt_stats()
+{
+        flush_tt_stats(); // include the results of the calling thread
+
+        uint64_t probes = TT.probes, hits = TT.hits;
+        uint64_t stores = TT.stores, collisions = TT.collisions;
+
+        printf("Hash size:         %zu MiB\n", ((TT.bucket_mask + 1) * sizeof(TTBucket)) >> 20);
+        printf("Hash hits:         %lu / %lu (%.2f%%)\n", hits, probes, probes ? 100.0 * hits / probes : 0.0);
+        printf("Hash collisions:   %lu / %lu (%.2f%%)\n", collisions, stores, stores ? 100.0 * collisions / stores : 0.0);
+}
+
+
+bool tt_probe(Key key, Depth depth, Nodes& nodes)
+{
+        auto& bucket = TT.bucket(key);
+        ThreadTTStats.probes += 1;
+
+        for (auto& entry : bucket.entries) {
+                auto data = entry.data.load(std::memory_order_relaxed);
+                auto check = entry.check.load(std::memory_order_relaxed);
+
+                if ((check ^ data) == key && (data & 0xff) == depth) {
+                        ThreadTTStats.hits += 1;
+                        nodes = data >> 8;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+
+void tt_store(Key key, Depth depth, Nodes nodes)
+{
+        auto& bucket = TT.bucket(key);
+        ThreadTTStats.stores += 1;
+
+        TTEntry* replace = nullptr;
+        Depth replace_depth = ~0u;
+
+        for (auto& entry : bucket.entries) {
+                auto data = entry.data.load(std::memory_order_relaxed);
+                auto check = entry.check.load(std::memory_order_relaxed);
+
+                // Overwrite our own result in place (possibly stored by another thread meanwhile).
+                if ((check ^ data) == key && (data & 0xff) == depth) {
+                        replace = &entry;
+                        replace_depth = 0;
+                        break;
+                }
+
+                if ((data & 0xff) < replace_depth) {
+                        replace = &entry;
+                        replace_depth = data & 0xff;
+                }
+        }
+
+        if (replace_depth != 0) ThreadTTStats.collisions += 1;
+
+        auto data = nodes << 8 | depth;
+
+        replace->check.store(key ^ data, std::memory_order_relaxed);
+        replace->data.store(data, std::memory_order_relaxed);
+}
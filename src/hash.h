@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include "board.h"
+#include "perft.h"
+#include "zobrist.h"
+
+
+// Multiply two words into 128 bits and fold the halves together (as in wyhash). Unlike simply
+// multiplying each bitboard by a constant, this mixes the high bits into the low bits and vice-versa.
+
+inline uint64_t fold_multiply(uint64_t a, uint64_t b)
+{
+        auto product = (unsigned __int128) a * b;
+        return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+
+// Hash all four bitboards of a board. As the board is color agnostic, so is the key, which is
+// exactly what we want for perft, as the result only depends on the stored bitboards.
+
+inline Key hash_board(Board const& board)
+{
+        auto xy = fold_multiply(board.x ^ 0x9e37'79b9'7f4a'7c15, board.y   ^ 0xc2b2'ae3d'27d4'eb4f);
+        auto zo = fold_multiply(board.z ^ 0x1656'67b1'9e37'79f9, board.our ^ 0xd6e8'feb8'6659'fd93);
+
+        return fold_multiply(xy ^ 0xa076'1d64'78bd'642f, zo ^ 0xe703'7ed1'a0b4'28db);
+}
+
+
+// Get the key of a board, which is free if the board already carries an incremental key.
+inline Key board_key(Board const& board)
+{
+#ifdef PERFT_INCREMENTAL_KEY
+        return board.key;
+#else
+        return hash_board(board);
+#endif
+}
+
+
+/*
+ *   Transposition table of perft results shared by all threads. Entries are lock-free, as each
+ *   stores its key XOR-ed with its data. A torn write by two racing threads will then fail the key
+ *   check on reading, and is simply treated as a miss. The data packs the node count in the upper
+ *   56 bits and the depth in the lower 8 bits, so an empty entry (data == 0) can never match, as
+ *   stored depths are always at least `TTMinimumDepth`.
+ *
+ *   Entries are grouped into buckets of four, which fill exactly one cache line. When storing, we
+ *   replace the entry of the shallowest depth, as deeper results save the most work.
+ */
+
+struct TTEntry {
+        std::atomic<uint64_t> check;
+        std::atomic<uint64_t> data;
+};
+
+struct alignas(64) TTBucket {
+        TTEntry entries[4];
+};
+
+struct TTStats {
+        uint64_t probes;
+        uint64_t hits;
+        uint64_t stores;
+        uint64_t collisions; // stores that evicted the result of a different position
+};
+
+
+struct TranspositionTable {
+        TTBucket* buckets;
+        size_t    bucket_mask;
+
+        // Totals of all thread local statistics, updated by `flush_tt_stats`.
+        std::atomic<uint64_t> probes, hits, stores, collisions;
+
+        bool enabled() const { return buckets != nullptr; }
+        TTBucket& bucket(Key key) { return buckets[key & bucket_mask]; }
+};
+
+constexpr Depth TTMinimumDepth = 3; // depths 1 and 2 are counted directly by count_moves and perft2
+
+extern TranspositionTable TT;
+[[gnu::tls_model("initial-exec")]] extern thread_local TTStats ThreadTTStats; // initial-exec, as in magic.h
+
+
+bool resize_tt(size_t megabytes);
+void clear_tt();
+void flush_tt_stats(); // should be called by each thread after it finishes searching
+void print_tt_stats();
+
+bool tt_probe(Key key, Depth depth, Nodes& nodes);
+void tt_store(Key key, Depth depth, Nodes nodes);
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "fen.h"
+#include "hash.h"
+#include "libperft.h"
+#include "magic.h"
+#include "movegen.h"
+#include "perft.h"
+#include "uci.h"
+
+
+// The position behind the opaque `perft_position`, as the board alone doesn't know whose move it is.
+struct LibraryPosition {
+        Board board;
+        bool  white_to_move;
+};
+
+static_assert(sizeof(LibraryPosition) <= sizeof(perft_position));
+static_assert(PERFT_MOVE_LENGTH == UCIMoveLength);
+static_assert(PERFT_MAX_MOVES == MaximumLegalMoves);
+static_assert(PERFT_FEN_LENGTH == FENMaximumLength);
+
+
+struct perft_context {
+        size_t number_of_threads;
+
+        // Asynchronous runs that haven't finished yet.
+        mtx_t  lock;
+        cnd_t  finished;
+        size_t number_of_running;
+};
+
+
+// The thread pool and transposition table belong to the process, so runs of all contexts take
+// turns. The lock also guards resizing the table, which must never happen during a run.
+
+once_flag LibraryOnce = ONCE_FLAG_INIT;
+mtx_t LibraryRunLock;
+size_t LibraryHashMegabytes = 0;
+
+
+void initialise_library()
+{
+        mtx_init(&LibraryRunLock, mtx_plain);
+        SelectedSliders = best_slider_backend();
+}
+
+
+LibraryPosition unpack_position(perft_position const* position)
+{
+        LibraryPosition unpacked;
+        memcpy(&unpacked, position, sizeof(unpacked));
+        return unpacked;
+}
+
+
+void pack_position(LibraryPosition const& unpacked, perft_position* position)
+{
+        *position = {};
+        memcpy(position, &unpacked, sizeof(unpacked));
+}
+
+
+extern "C" perft_context* perft_create(size_t threads, size_t hash_mib)
+{
+        call_once(&LibraryOnce, initialise_library);
+
+        if (threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads > MaximumThreads) threads = MaximumThreads;
+
+        mtx_lock(&LibraryRunLock);
+        bool ok = true;
+
+        if (hash_mib > LibraryHashMegabytes) {
+                ok = resize_tt(hash_mib);
+                LibraryHashMegabytes = ok ? hash_mib : 0;
+        }
+
+        mtx_unlock(&LibraryRunLock);
+        if (!ok) return nullptr;
+
+        auto context = new perft_context;
+
+        context->number_of_threads = threads;
+        context->number_of_running = 0;
+        mtx_init(&context->lock, mtx_plain);
+        cnd_init(&context->finished);
+
+        return context;
+}
+
+
+extern "C" void perft_destroy(perft_context* context)
+{
+        perft_wait(context);
+
+        mtx_destroy(&context->lock);
+        cnd_destroy(&context->finished);
+        delete context;
+}
+
+
+extern "C" int perft_parse_fen(char const* fen, perft_position* position)
+{
+        LibraryPosition unpacked;
+        FENInfo info;
+
+        auto error = parse_fen(fen, unpacked.board, info);
+        if (error != FENOk) return error;
+
+        unpacked.white_to_move = info.white_to_move;
+        pack_position(unpacked, position);
+
+        return 0;
+}
+
+
+extern "C" char const* perft_error_message(int error)
+{
+        if (error < 0 || error >= NumberOfFENErrors) return "unknown error";
+        return FENErrorMessages[error];
+}
+
+
+extern "C" void perft_format_fen(perft_position const* position, char fen[PERFT_FEN_LENGTH])
+{
+        auto unpacked = unpack_position(position);
+        format_fen(unpacked.board, unpacked.white_to_move, fen);
+}
+
+
+extern "C" int perft_make_move(perft_position* position, char const* move)
+{
+        auto unpacked = unpack_position(position);
+        if (!make_uci_move(unpacked.board, unpacked.white_to_move, move, strlen(move), unpacked.board)) return 0;
+
+        unpacked.white_to_move = !unpacked.white_to_move;
+        pack_position(unpacked, position);
+
+        return 1;
+}
+
+
+extern "C" size_t perft_legal_moves(perft_position const* position, char moves[][PERFT_MOVE_LENGTH], size_t capacity)
+{
+        auto unpacked = unpack_position(position);
+        auto buffer = generate_moves(unpacked.board);
+        size_t number_of_moves = 0;
+
+        for (size_t i = 0; i < buffer.size; ++i, ++number_of_moves) {
+                if (number_of_moves < capacity) format_move(unpacked.board, buffer.moves[i], unpacked.white_to_move, moves[number_of_moves]);
+        }
+
+        while (buffer.pawn_pushes) {
+                auto move = pawn_push_move(unpacked.board, trailing_zeros_and_pop(buffer.pawn_pushes));
+                if (number_of_moves < capacity) format_move(unpacked.board, move, unpacked.white_to_move, moves[number_of_moves]);
+                number_of_moves += 1;
+        }
+
+        return number_of_moves;
+}
+
+
+extern "C" uint64_t perft_count(perft_context* context, perft_position const* position, unsigned depth)
+{
+        if (depth == 0) return 1; // definition of perft 0
+
+        PerftJob job = { unpack_position(position).board, depth };
+
+        mtx_lock(&LibraryRunLock);
+        auto nodes = threaded_perft(&job, 1, context->number_of_threads);
+        mtx_unlock(&LibraryRunLock);
+
+        return nodes;
+}
+
+
+// Divides report their root moves one at a time, so that user callbacks needn't be thread-safe.
+struct LibraryDivide {
+        char (*moves)[UCIMoveLength];
+        perft_divide_callback callback;
+        void* user;
+        mtx_t lock;
+};
+
+
+void report_library_move(void* opaque_divide, size_t job, Nodes nodes, Seconds)
+{
+        auto& divide = *(LibraryDivide*) opaque_divide;
+
+        mtx_lock(&divide.lock);
+        divide.callback(divide.user, divide.moves[job], nodes);
+        mtx_unlock(&divide.lock);
+}
+
+
+extern "C" uint64_t perft_divide(perft_context* context, perft_position const* position, unsigned depth,
+                                 perft_divide_callback callback, void* user)
+{
+        if (depth == 0) return 1;
+
+        auto unpacked = unpack_position(position);
+
+        PerftJob jobs[MaximumLegalMoves];
+        char moves[MaximumLegalMoves][UCIMoveLength];
+        size_t number_of_jobs = 0;
+
+        auto buffer = generate_moves(unpacked.board);
+
+        for (size_t i = 0; i < buffer.size; ++i) {
+                format_move(unpacked.board, buffer.moves[i], unpacked.white_to_move, moves[number_of_jobs]);
+                jobs[number_of_jobs++] = { make_move(unpacked.board, buffer.moves[i]), depth - 1 };
+        }
+
+        while (buffer.pawn_pushes) {
+                auto dest = trailing_zeros_and_pop(buffer.pawn_pushes);
+
+                format_move(unpacked.board, pawn_push_move(unpacked.board, dest), unpacked.white_to_move, moves[number_of_jobs]);
+                jobs[number_of_jobs++] = { make_pawn_push(unpacked.board, dest), depth - 1 };
+        }
+
+        LibraryDivide divide = { moves, callback, user, {} };
+        mtx_init(&divide.lock, mtx_plain);
+
+        mtx_lock(&LibraryRunLock);
+        auto nodes = threaded_perft(jobs, number_of_jobs, context->number_of_threads, report_library_move, &divide);
+        mtx_unlock(&LibraryRunLock);
+
+        mtx_destroy(&divide.lock);
+        return nodes;
+}
+
+
+// Asynchronous runs each get a thread of their own, which just waits for its turn and then makes
+// the synchronous call. The counting itself is still done by the pool.
+
+struct LibraryRun {
+        perft_context*        context;
+        perft_position        position;
+        unsigned              depth;
+        perft_divide_callback callback; // null to count without divide
+        perft_done_callback   done;
+        void*                 user;
+};
+
+
+int start_library_run(void* opaque_run)
+{
+        auto run = (LibraryRun*) opaque_run;
+        auto context = run->context;
+
+        auto nodes = run->callback ? perft_divide(context, &run->position, run->depth, run->callback, run->user)
+                                   : perft_count(context, &run->position, run->depth);
+
+        if (run->done) run->done(run->user, nodes);
+        delete run;
+
+        mtx_lock(&context->lock);
+        if (--context->number_of_running == 0) cnd_broadcast(&context->finished);
+        mtx_unlock(&context->lock);
+
+        return 0;
+}
+
+
+extern "C" int perft_divide_async(perft_context* context, perft_position const* position, unsigned depth,
+                                  perft_divide_callback callback, perft_done_callback done, void* user)
+{
+        auto run = new LibraryRun { context, *position, depth, callback, done, user };
+
+        mtx_lock(&context->lock);
+        context->number_of_running += 1;
+        mtx_unlock(&context->lock);
+
+        thrd_t thread;
+
+        if (thrd_create(&thread, start_library_run, run) != thrd_success) {
+                mtx_lock(&context->lock);
+                if (--context->number_of_running == 0) cnd_broadcast(&context->finished);
+                mtx_unlock(&context->lock);
+
+                delete run;
+                return 0;
+        }
+
+        thrd_detach(thread);
+        return 1;
+}
+
+
+extern "C" int perft_count_async(perft_context* context, perft_position const* position, unsigned depth,
+                                 perft_done_callback done, void* user)
+{
+        return perft_divide_async(context, position, depth, nullptr, done, user);
+}
+
+
+extern "C" void perft_wait(perft_context* context)
+{
+        mtx_lock(&context->lock);
+        while (context->number_of_running > 0) cnd_wait(&context->finished, &context->lock);
+        mtx_unlock(&context->lock);
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *   C interface of the perft library, for embedding the move generator in other programs, e.g. to
+ *   test a chess engine against it. Build `src/library_build.cc` as a static or shared library (see
+ *   README.md) and include this header, which is plain C.
+ *
+ *   A context holds the threads and hash size of its runs. All functions are reentrant, and any
+ *   number of contexts can be used from any threads, but runs from all contexts of the process
+ *   share one pool of threads and one transposition table, so they are run one at a time. The
+ *   table holds results of any position, so it is simply kept at the largest size of any context.
+ *
+ *   Positions are plain values, which can be copied and used by many runs at once.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Only this interface is exported, when built with -fvisibility=hidden. */
+#define PERFT_API __attribute__((visibility("default")))
+
+#define PERFT_MOVE_LENGTH   6   /* of a move in UCI notation, e.g. "e7e8q", including the NUL */
+#define PERFT_MAX_MOVES     218 /* legal moves of any position */
+#define PERFT_FEN_LENGTH    96  /* of a formatted position, including the NUL */
+
+typedef struct perft_context perft_context;
+
+typedef struct perft_position {
+        uint64_t opaque[6];
+} perft_position;
+
+/* Called for each root move of a divide as soon as it is counted, one call at a time. It must not
+   make a synchronous run, as the run that calls it isn't finished. */
+typedef void (*perft_divide_callback)(void* user, char const* move, uint64_t nodes);
+
+/* Called when an asynchronous run is finished, with its total node count. */
+typedef void (*perft_done_callback)(void* user, uint64_t nodes);
+
+
+/* Create a context counting on `threads` threads (0 for all cpus), with a transposition table of
+   `hash_mib` MiB (0 to disable it). Returns NULL if the table can't be allocated. */
+PERFT_API perft_context* perft_create(size_t threads, size_t hash_mib);
+
+/* Wait for the asynchronous runs of the context, and free it. */
+PERFT_API void perft_destroy(perft_context* context);
+
+
+/* Parse a position in FEN, returns 0, or an error code for `perft_error_message`. */
+PERFT_API int perft_parse_fen(char const* fen, perft_position* position);
+PERFT_API char const* perft_error_message(int error);
+
+PERFT_API void perft_format_fen(perft_position const* position, char fen[PERFT_FEN_LENGTH]);
+
+/* Make a move in UCI notation, returns 0 if it isn't legal, and leaves the position unchanged. */
+PERFT_API int perft_make_move(perft_position* position, char const* move);
+
+/* Write up to `capacity` legal moves in UCI notation, returns the number of legal moves. */
+PERFT_API size_t perft_legal_moves(perft_position const* position, char moves[][PERFT_MOVE_LENGTH], size_t capacity);
+
+
+/* Count the leaf nodes at `depth`, on the threads of the context. */
+PERFT_API uint64_t perft_count(perft_context* context, perft_position const* position, unsigned depth);
+
+/* The same, also reporting the count of every root move, depth must be positive. */
+PERFT_API uint64_t perft_divide(perft_context* context, perft_position const* position, unsigned depth,
+                                perft_divide_callback callback, void* user);
+
+/* Start a count or divide in the background and return at once, `done` (if not NULL) is called when
+   it is finished. The callbacks are called from other threads. Returns 0 if it couldn't be started. */
+PERFT_API int perft_count_async(perft_context* context, perft_position const* position, unsigned depth,
+                                perft_done_callback done, void* user);
+PERFT_API int perft_divide_async(perft_context* context, perft_position const* position, unsigned depth,
+                                 perft_divide_callback callback, perft_done_callback done, void* user);
+
+/* Wait for all asynchronous runs started on the context. */
+PERFT_API void perft_wait(perft_context* context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,10 @@
+// Unity build of the library (see libperft.h), without the command line program and its modes
+#include "affinity.cc"
+#include "batch.cc"
+#include "fen.cc"
+#include "hash.cc"
+#include "magic.cc"
+#include "movegen.cc"
+#include "uci.cc"
+#include "perft.cc"
+#include "libperft.cc"
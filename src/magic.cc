@@ -1,21 +1,59 @@
+#include <initializer_list>
 #include <assert.h>
+#include <stddef.h>
+#include <string.h>
 #include "bitboard.h"
 #include "magic.h"
 
 typedef int DiagonalIndex;
 
-constexpr size_t SlidingAttacksTableSize = 107648;
-
-BitBoard KnightAttacks[64+1];
-BitBoard KingAttacks[64];
-BitBoard SlidingAttacks[SlidingAttacksTableSize];
-BitBoard LineBetween[64][64];
-
-Magic BishopMagics[64];
-Magic RookMagics[64];
-
-
-inline unsigned leading_zeros(BitBoard bb) {
+SliderBackend SelectedSliders = PextSliders;
+
+
+// Magic numbers for the fancy magic backend. These were found by trying random sparse numbers (the
+// AND of three random numbers), until all occupancies of a square map to distinct indices, or to
+// indices of the same attack set.
+
+constexpr BitBoard BishopMagicNumbers[64] = {
+        0x020420028c018885, 0xc0100181040881c0, 0x014424440040108c, 0x0008084100010040,
+        0x8504050402100022, 0x2022021004200000, 0x0014088828080590, 0x8200420090a01020,
+        0x4400060410040102, 0x6c00200282104100, 0x1404b0092200300c, 0xe204081681000420,
+        0x000204042020101c, 0x0820208210402220, 0x4180408808080500, 0x2640014a44100884,
+        0x08122025200a0400, 0x001054a004412040, 0x0308011002544108, 0x394400080c208830,
+        0x0001010490400a82, 0x3400420201100122, 0x0113000200ca2004, 0x0000880042280100,
+        0x0182200008093000, 0x0008440002040800, 0x1002110088004402, 0xc020090208004008,
+        0x0001001001004000, 0x1004810006004242, 0x40010610240a0102, 0x0091310000404800,
+        0x004a904080100a41, 0x02020120001002c2, 0x01040a0800010040, 0x0081110800040040,
+        0x0010020080001004, 0x2098500100002080, 0x101008850400840e, 0x00180c6084044200,
+        0x2088020210102042, 0x40c0580808004400, 0x1000084402101000, 0x00c0004010400200,
+        0x202040010a000100, 0x0040900441401082, 0x81041000a2000100, 0x0001820400400100,
+        0x1001009090080000, 0x302104008248040c, 0xa40200c202b00014, 0xc000002884241228,
+        0x4204011002020481, 0x1000411002008000, 0x9008200c30922080, 0x0210100e00514901,
+        0x6002004100882004, 0x8a20402088041000, 0x0000065042080440, 0x8400040000420218,
+        0x0458000a11820211, 0x0400108414482a0a, 0x011c400228920080, 0x04220404080e0421,
+};
+
+constexpr BitBoard RookMagicNumbers[64] = {
+        0x2280004000102482, 0xa440100020044000, 0x09000d0010200040, 0x8080080010008004,
+        0xa280080002340080, 0x2500050024000208, 0x0280010000800200, 0x1100144380220100,
+        0xa92080048c204002, 0x0802804003200080, 0x0108802000100089, 0x8060800800801002,
+        0xa002000822000410, 0x950a001002000824, 0x1202000408010200, 0x02950008408a0100,
+        0x40a0a18000814000, 0x0080848020004011, 0x0800828010002000, 0x0500420010200a00,
+        0x0008818004000802, 0x0000808004000200, 0x0000040001020810, 0x0081120000442081,
+        0x0522400180002090, 0x2800200040401000, 0x402004a180100481, 0x0880420200200810,
+        0x000a040080800800, 0x080a000404001020, 0x0000010400820810, 0x4000d08200004c09,
+        0x0100804000800020, 0xcc01028026004200, 0x0081002001004010, 0x0000800800801000,
+        0x0009800401802800, 0x0002000902000410, 0x0000180144001022, 0x00008100c6002884,
+        0x1200800040008024, 0x2000200050044000, 0x0090882200420010, 0x6a1810200a020040,
+        0x0480040008008080, 0x0206001108160014, 0xc010040200010100, 0x000001018046000c,
+        0x00b0400880042080, 0x0040002010080220, 0x0020004228110100, 0x0150000804004140,
+        0x0028008004000980, 0x0801000804000300, 0x2c80210208900400, 0x0000040130408200,
+        0x4001409100258001, 0x0005004002883021, 0x019041e003001019, 0x8000200900041001,
+        0x4021001002040801, 0x0011000400080201, 0x1600010210408804, 0x2010810084003042,
+};
+
+
+constexpr unsigned leading_zeros(BitBoard bb) {
         return __builtin_clzll(bb);
 }
 
@@ -24,13 +62,13 @@ inline unsigned leading_zeros(BitBoard bb) {
 // main diagonal (index 0) being A1 to H8. The index (n) specifies the digonal, with positive
 // shifting the digonal toward A8, and negative toward H1.
 
-BitBoard generate_diagonal(DiagonalIndex index) {
+constexpr BitBoard generate_diagonal(DiagonalIndex index) {
         BitBoard main_diag = 0x8040201008040201;
         return (index > 0) ? main_diag << (8 * index) : main_diag >> -(8 * index);
 }
 
 
-BitBoard generate_sliding_attacks(Square sq, BitBoard mask, BitBoard occ)
+constexpr BitBoard generate_sliding_attacks(Square sq, BitBoard mask, BitBoard occ)
 {
         occ &= mask; // only use the occupancy of Squares we need
         auto bit = OneBB << sq;
@@ -43,106 +81,222 @@ BitBoard generate_sliding_attacks(Square sq, BitBoard mask, BitBoard occ)
 }
 
 
+// The four lines through a Square, that sliding pieces move along.
+struct Lines {
+        BitBoard diag, anti, file, rank;
+};
+
+constexpr Lines generate_lines(Square sq)
+{
+        Square file = sq & 7, rank = sq >> 3;
+
+        return {
+                .diag = generate_diagonal(rank - file),
+                .anti = rotate(generate_diagonal(7 - rank - file)),
+                .file = file_of(sq),
+                .rank = rank_of(sq),
+        };
+}
+
+
 //  Generate the line (diagonal or orthogonal) between two Squares, used for pinned piece masks and
 //  blocking checks. The mask returned does include the bit for Square b, used to allow pieces to
 //  capture a checking piece.
 
-BitBoard generate_line_between(Square from, Square dest)
+constexpr BitBoard generate_line_between(Square from, Square dest)
 {
+        auto lines = generate_lines(from);
+
         auto from_bb = OneBB << from;
         auto dest_bb = OneBB << dest;
 
-        auto diag = BishopMagics[from].attacks(dest_bb);
-        auto orth = RookMagics[from].attacks(dest_bb);
-
         auto line = EmptyBB;
 
-        if (diag & dest_bb)  line = diag & BishopMagics[dest].attacks(from_bb);
-        if (orth & dest_bb)  line = orth & RookMagics[dest].attacks(from_bb);
+        // If both Squares are on a line, the line between them is where their attacks along it overlap.
+        for (auto mask : { lines.diag, lines.anti, lines.file, lines.rank }) {
+                if (mask & dest_bb) line = generate_sliding_attacks(from, mask, dest_bb)
+                                         & generate_sliding_attacks(dest, mask, from_bb);
+        }
 
         return line | dest_bb;
 }
 
 
-void init_bitboard_tables()
+// Extract the bits of a BitBoard selected by a mask, like PEXT, but usable at compile time.
+constexpr BitBoard extract_bits(BitBoard bb, BitBoard mask)
+{
+        BitBoard result = 0;
+
+        for (BitBoard bit = 1; mask; bit <<= 1, mask &= mask - 1) {
+                if (bb & mask & -mask) result |= bit;
+        }
+
+        return result;
+}
+
+
+// Store the attacks of every occupancy of a mask in the slots of a square for both backends. The
+// carry-rippler trick below iterates over the subsets of the mask in the order of their PEXT index.
+
+constexpr void store_sliding_attacks(AttackTables& tables, Magic const& magic, size_t index,
+                                     Square sq, BitBoard line_a, BitBoard line_b)
+{
+        auto occ = EmptyBB;
+        size_t pext_index = 0;
+
+        do {
+                auto attacks = generate_sliding_attacks(sq, line_a, occ) | generate_sliding_attacks(sq, line_b, occ);
+                auto magic_index = (occ * magic.magic) >> magic.shift;
+
+                // Different occupancies may only share a magic index if they have the same attacks.
+                auto& magic_entry = tables.sliding_attacks[index + MagicSlotsOffset + magic_index];
+                assert(magic_entry == 0 || magic_entry == attacks);
+                magic_entry = attacks;
+
+#ifdef PERFT_COMPRESSED_SLIDERS
+                tables.compressed_attacks[index + pext_index++] = extract_bits(attacks, magic.rays);
+#else
+                tables.sliding_attacks[index + pext_index++] = attacks;
+#endif
+
+                occ = (occ - magic.mask) & magic.mask; // iterate over all subset BitBoards of a BitBoard
+        }
+        while (occ);
+}
+
+
+constexpr AttackTables::AttackTables()
+        : knight_attacks(), king_attacks(), line_between(), bishop_magics(), rook_magics(), sliding_attacks()
+#ifdef PERFT_COMPRESSED_SLIDERS
+        , compressed_attacks()
+#endif
 {
-        int index = 0;
+        size_t index = 0;
 
         for (Square sq = A1; sq <= H8; ++sq) {
                 auto bit = OneBB << sq;
+                auto lines = generate_lines(sq);
 
-                KnightAttacks[sq] = north(north(east(bit))) | north(north(west(bit)))
-                                  | south(south(east(bit))) | south(south(west(bit)))
-                                  | east(east(north(bit)))  | east(east(south(bit)))
-                                  | west(west(north(bit)))  | west(west(south(bit)));
+                knight_attacks[sq] = north(north(east(bit))) | north(north(west(bit)))
+                                   | south(south(east(bit))) | south(south(west(bit)))
+                                   | east(east(north(bit)))  | east(east(south(bit)))
+                                   | west(west(north(bit)))  | west(west(south(bit)));
 
-                KingAttacks[sq] = north(bit) | east(bit) | south(bit) | west(bit)
-                                | north(east(bit)) | north(west(bit)) | south(east(bit)) | south(west(bit));
+                king_attacks[sq] = north(bit) | east(bit) | south(bit) | west(bit)
+                                 | north(east(bit)) | north(west(bit)) | south(east(bit)) | south(west(bit));
 
 
                 // bishop attacks
                 {
-                        Square file = sq & 7, rank = sq >> 3;
-
-                        auto diag = generate_diagonal(rank - file);
-                        auto anti = rotate(generate_diagonal(7 - rank - file));
-
                         // Clear outer bits of mask. These not needed for magic BitBoards as a
                         // sliding piece can always move to the edge of the board if the Square
                         // just before is unoccupied. We also clear the bit of the Square as this
                         // is always occupied by the moving piece itself so is irrelevant.
 
                         auto outer = FileABB | FileHBB | Rank1BB | Rank8BB | bit;
-                        auto mask = (diag | anti) &~ outer;
-
-                        BishopMagics[sq].mask = mask;
-                        BishopMagics[sq].table = SlidingAttacks + index;
-                        auto occ = EmptyBB;
-
-                        do {
-                                SlidingAttacks[index++] = generate_sliding_attacks(sq, diag, occ)
-                                                        | generate_sliding_attacks(sq, anti, occ);
-                                occ = (occ - mask) & mask; // iterate over all subset BitBoards of a BitBoard
-                        }
-                        while (occ);
+                        auto mask = (lines.diag | lines.anti) &~ outer;
+
+                        auto& magic = bishop_magics[sq];
+                        magic = { .table = sliding_attacks + index, .mask = mask, .magic = BishopMagicNumbers[sq], .shift = 64 - popcount(mask) };
+
+#ifdef PERFT_COMPRESSED_SLIDERS
+                        magic.compressed_table = compressed_attacks + index;
+                        magic.rays = generate_sliding_attacks(sq, lines.diag, EmptyBB) | generate_sliding_attacks(sq, lines.anti, EmptyBB);
+#endif
+
+                        store_sliding_attacks(*this, magic, index, sq, lines.diag, lines.anti);
+
+                        index += OneBB << popcount(mask);
                 }
 
                 // rook attacks
                 {
-                        auto file = file_of(sq);
-                        auto rank = rank_of(sq);
-
                         // Rook moves are generated using the same techniques as bishop moves
                         // above, except more care must be taken with the board edges.
 
                         auto file_outer = Rank1BB | Rank8BB;
                         auto rank_outer = FileABB | FileHBB;
 
-                        auto mask = ((file &~ file_outer) | (rank &~ rank_outer)) &~ bit;
+                        auto mask = ((lines.file &~ file_outer) | (lines.rank &~ rank_outer)) &~ bit;
 
-                        RookMagics[sq].mask = mask;
-                        RookMagics[sq].table = SlidingAttacks + index;
+                        auto& magic = rook_magics[sq];
+                        magic = { .table = sliding_attacks + index, .mask = mask, .magic = RookMagicNumbers[sq], .shift = 64 - popcount(mask) };
 
-                        auto occ = EmptyBB;
+#ifdef PERFT_COMPRESSED_SLIDERS
+                        magic.compressed_table = compressed_attacks + index;
+                        magic.rays = generate_sliding_attacks(sq, lines.file, EmptyBB) | generate_sliding_attacks(sq, lines.rank, EmptyBB);
+#endif
 
-                        do {
-                                SlidingAttacks[index++] = generate_sliding_attacks(sq, file, occ)
-                                                        | generate_sliding_attacks(sq, rank, occ);
-                                occ = (occ - mask) & mask;
-                        }
-                        while (occ);
+                        store_sliding_attacks(*this, magic, index, sq, lines.file, lines.rank);
+
+                        index += OneBB << popcount(mask);
                 }
         }
 
         assert(index == SlidingAttacksTableSize);
 
-
-        // LineBetween must be generated after as sliding attacks as it relies on bishop and
-        // rook moves already being initialised.
-
         for (Square from = A1; from <= H8; ++from) {
                 for (Square dest = A1; dest <= H8; ++dest) {
-                        LineBetween[from][dest] = generate_line_between(from, dest);
+                        line_between[from][dest] = generate_line_between(from, dest);
                 }
         }
 }
+
+
+constexpr AttackTables PrimaryAttackTables;
+
+[[gnu::tls_model("initial-exec")]] thread_local constinit BitBoard const* KnightAttacks = PrimaryAttackTables.knight_attacks;
+[[gnu::tls_model("initial-exec")]] thread_local constinit BitBoard const* KingAttacks = PrimaryAttackTables.king_attacks;
+[[gnu::tls_model("initial-exec")]] thread_local constinit BitBoard const (*LineBetween)[64] = PrimaryAttackTables.line_between;
+
+[[gnu::tls_model("initial-exec")]] thread_local constinit Magic const* BishopMagics = PrimaryAttackTables.bishop_magics;
+[[gnu::tls_model("initial-exec")]] thread_local constinit Magic const* RookMagics = PrimaryAttackTables.rook_magics;
+
+
+SliderBackend best_slider_backend()
+{
+        __builtin_cpu_init();
+
+        if (!__builtin_cpu_supports("bmi2")) return MagicSliders;
+        if (__builtin_cpu_is("znver1") || __builtin_cpu_is("znver2")) return MagicSliders; // microcoded PEXT
+
+        return PextSliders;
+}
+
+
+void copy_attack_tables(AttackTables& copy)
+{
+        auto& tables = PrimaryAttackTables;
+
+#ifdef PERFT_COMPRESSED_SLIDERS
+        memcpy((void*) &copy, &tables, sizeof(AttackTables));
+#else
+        // The slots of the other backend are never read, so leave them out.
+        auto offset = SelectedSliders * SlidingAttacksTableSize;
+
+        memcpy((void*) &copy, &tables, offsetof(AttackTables, sliding_attacks));
+        memcpy(copy.sliding_attacks + offset, tables.sliding_attacks + offset, SlidingAttacksTableSize * sizeof(BitBoard));
+#endif
+
+        auto rebase = [&](Magic& magic, Magic const& original) {
+                magic.table = copy.sliding_attacks + (original.table - tables.sliding_attacks);
+#ifdef PERFT_COMPRESSED_SLIDERS
+                magic.compressed_table = copy.compressed_attacks + (original.compressed_table - tables.compressed_attacks);
+#endif
+        };
+
+        for (Square sq = A1; sq <= H8; ++sq) {
+                rebase(copy.bishop_magics[sq], tables.bishop_magics[sq]);
+                rebase(copy.rook_magics[sq],   tables.rook_magics[sq]);
+        }
+}
+
+
+void select_attack_tables(AttackTables const& tables)
+{
+        KnightAttacks = tables.knight_attacks;
+        KingAttacks   = tables.king_attacks;
+        LineBetween   = tables.line_between;
+        BishopMagics  = tables.bishop_magics;
+        RookMagics    = tables.rook_magics;
+}
@@ -2,21 +2,135 @@
 #include <x86intrin.h>
 #include "bitboard.h"
 
+/*
+ *   Sliding attacks are looked up in a table, which has a slot of 2^n attack sets for every square,
+ *   where n is the number of relevant occupancy bits. There are two backends to index these slots:
+ *
+ *   - PEXT bitboards, which simply extract the relevant occupancy bits. This needs BMI2, and is only
+ *     fast on Intel and on AMD since Zen 3 (on Zen 1 and 2 PEXT is microcoded, and very slow).
+ *
+ *   - Fancy magic bitboards, which multiply the relevant occupancy by a magic number, such that the
+ *     top n bits of the product form a unique index. This only needs a 64-bit multiply.
+ *
+ *   The table holds every slot twice, once ordered for each backend. It is generated at compile time
+ *   and kept in read-only memory, so that startup costs nothing, concurrent processes share the same
+ *   physical pages, and only the pages of the backend chosen at startup (with CPUID) are ever read.
+ *   All of the move generation is compiled for both (see movegen.h), so that choice costs nothing
+ *   per node.
+ */
+
+enum SliderBackend { PextSliders, MagicSliders };
+
+extern SliderBackend SelectedSliders;
+
+
+// With BMI2 disabled at compile time (for CPUs without it), PEXT is still available through inline
+// assembly, as long as it is only run on CPUs that support it.
+
+inline BitBoard pext(BitBoard bb, BitBoard mask)
+{
+#ifdef __BMI2__
+        return _pext_u64(bb, mask);
+#else
+        BitBoard result;
+        asm ("pextq %2, %1, %0" : "=r" (result) : "r" (bb), "rm" (mask));
+        return result;
+#endif
+}
+
+inline BitBoard pdep(BitBoard bb, BitBoard mask)
+{
+#ifdef __BMI2__
+        return _pdep_u64(bb, mask);
+#else
+        BitBoard result;
+        asm ("pdepq %2, %1, %0" : "=r" (result) : "r" (bb), "rm" (mask));
+        return result;
+#endif
+}
+
+
+/*
+ *   When compiled with `-DPERFT_COMPRESSED_SLIDERS`, the PEXT backend stores each attack set as only
+ *   the 16 bits of the rays of its square (at most 14 for a rook), and deposits them back onto the
+ *   rays with PDEP. This shrinks its slots to a quarter, about 210 KB, so that they fit in L2, at
+ *   the cost of one more instruction per lookup. The magic backend is unchanged, as it can't rely on
+ *   PDEP being available.
+ */
+
+constexpr size_t SlidingAttacksTableSize = 107648;
+
+#ifdef PERFT_COMPRESSED_SLIDERS
+constexpr size_t MagicSlotsOffset = 0; // the PEXT slots are kept separately
+#else
+constexpr size_t MagicSlotsOffset = SlidingAttacksTableSize;
+#endif
+
 
 struct Magic {
-        BitBoard* table;
-        BitBoard  mask;
+        BitBoard const* table; // slot for PEXT, the slot for magics follows `MagicSlotsOffset` later
+        BitBoard        mask;
+        BitBoard        magic;
+        unsigned        shift;
 
-        BitBoard attacks(BitBoard occupied) {
-                return table[_pext_u64(occupied, mask)];
+#ifdef PERFT_COMPRESSED_SLIDERS
+        uint16_t const* compressed_table; // slot for PEXT
+        BitBoard        rays;
+#endif
+
+        template <SliderBackend Sliders>
+        BitBoard attacks(BitBoard occupied) const {
+#ifdef PERFT_COMPRESSED_SLIDERS
+                if constexpr (Sliders == PextSliders) return pdep(compressed_table[pext(occupied, mask)], rays);
+#else
+                if constexpr (Sliders == PextSliders) return table[pext(occupied, mask)];
+#endif
+                else return table[MagicSlotsOffset + (((occupied & mask) * magic) >> shift)];
+        }
+
+        // For code outside of move generation, which isn't compiled for each backend.
+        BitBoard attacks(BitBoard occupied) const {
+                return SelectedSliders == PextSliders ? attacks<PextSliders>(occupied)
+                                                      : attacks<MagicSliders>(occupied);
         }
 };
 
-extern BitBoard KnightAttacks[64+1]; // extra slot for loop unrolling
-extern BitBoard KingAttacks[64];
-extern BitBoard LineBetween[64][64];
 
-extern struct Magic BishopMagics[64];
-extern struct Magic RookMagics[64];
+/*
+ *   All attack tables are kept together, so that they can be copied as a whole, e.g. to the local
+ *   memory of each NUMA node (see affinity.h). Every thread reads the tables through its own
+ *   pointers below, which point to the primary tables until the thread selects a copy.
+ */
+
+struct AttackTables {
+        BitBoard knight_attacks[64+1]; // extra slot for loop unrolling
+        BitBoard king_attacks[64];
+        BitBoard line_between[64][64];
+
+        Magic    bishop_magics[64];
+        Magic    rook_magics[64];
+#ifdef PERFT_COMPRESSED_SLIDERS
+        BitBoard sliding_attacks[SlidingAttacksTableSize]; // slots for magics
+        uint16_t compressed_attacks[SlidingAttacksTableSize]; // slots for PEXT
+#else
+        BitBoard sliding_attacks[2 * SlidingAttacksTableSize]; // slots for PEXT, then for magics
+#endif
+
+        constexpr AttackTables();
+};
+
+extern AttackTables const PrimaryAttackTables;
+
+// The initial-exec model reads these with a single load from the thread pointer, also when built
+// with -fPIC as a library (see libperft.h), where the default would call `__tls_get_addr` for every
+// lookup in move generation. They only take a few bytes of the static TLS space.
+[[gnu::tls_model("initial-exec")]] extern thread_local constinit BitBoard const* KnightAttacks;
+[[gnu::tls_model("initial-exec")]] extern thread_local constinit BitBoard const* KingAttacks;
+[[gnu::tls_model("initial-exec")]] extern thread_local constinit BitBoard const (*LineBetween)[64];
+
+[[gnu::tls_model("initial-exec")]] extern thread_local constinit Magic const* BishopMagics;
+[[gnu::tls_model("initial-exec")]] extern thread_local constinit Magic const* RookMagics;
 
-void init_bitboard_tables();
+SliderBackend best_slider_backend(); // from CPUID
+void copy_attack_tables(AttackTables& copy); // of the primary tables, pointing the magics to the copy
+void select_attack_tables(AttackTables const& tables); // for the calling thread
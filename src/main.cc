@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "bench.h"
+#include "board.h"
+#include "distributed.h"
+#include "fen.h"
+#include "hash.h"
+#include "magic.h"
+#include "microbench.h"
+#include "movegen.h"
+#include "perft.h"
+#include "server.h"
+#include "suite.h"
+#include "uci.h"
+
+// Perft divide reports the node count of every root move as soon as it is finished, as either
+// plain text or newline-delimited JSON. This is used to find bugs by comparing with other move
+// generators, so the moves are all counted in parallel, and we stream results as early as possible.
+
+struct DivideContext {
+        char (*moves)[UCIMoveLength];
+        bool json;
+};
+
+
+void report_divide_move(void* opaque_context, size_t job, Nodes nodes, Seconds)
+{
+        auto& context = *(DivideContext*) opaque_context;
+
+        // Called from worker threads, but as stdio locks the stream for each call, lines never interleave.
+        if (context.json) printf("{\"move\":\"%s\",\"nodes\":%lu}\n", context.moves[job], nodes);
+        else              printf("%-5s  %lu\n", context.moves[job], nodes);
+
+        fflush(stdout);
+}
+
+
+Nodes divide(Board const& board, bool white_to_move, Depth depth, size_t number_of_threads, bool json,
+             MoveStatistics* stats)
+{
+        assert(depth > 0);
+
+        PerftJob jobs[MaximumLegalMoves];
+        char moves[MaximumLegalMoves][UCIMoveLength];
+        size_t number_of_jobs = 0;
+
+        auto buffer = generate_moves(board);
+
+        for (size_t i = 0; i < buffer.size; ++i) {
+                format_move(board, buffer.moves[i], white_to_move, moves[number_of_jobs]);
+                jobs[number_of_jobs++] = { make_move(board, buffer.moves[i]), depth - 1 };
+        }
+
+        while (buffer.pawn_pushes) {
+                auto dest = trailing_zeros_and_pop(buffer.pawn_pushes);
+
+                format_move(board, pawn_push_move(board, dest), white_to_move, moves[number_of_jobs]);
+                jobs[number_of_jobs++] = { make_pawn_push(board, dest), depth - 1 };
+        }
+
+        DivideContext context = { moves, json };
+        MoveStatistics move_stats[MaximumLegalMoves];
+
+        auto nodes = threaded_perft(jobs, number_of_jobs, number_of_threads, report_divide_move, &context,
+                                    stats ? move_stats : nullptr);
+
+        // At depth 1 the root moves are the last ply, which the jobs of depth 0 don't classify.
+        if (stats) {
+                *stats = {};
+
+                if (depth == 1) collect_move_statistics(board, *stats);
+                else for (size_t i = 0; i < number_of_jobs; ++i) *stats += move_stats[i];
+        }
+
+        return nodes;
+}
+
+
+void print_statistics(MoveStatistics const& stats, bool json)
+{
+        if (json) {
+                printf("{\"captures\":%lu,\"en_passants\":%lu,\"castles\":%lu,\"promotions\":%lu,"
+                       "\"checks\":%lu,\"discovered_checks\":%lu,\"double_checks\":%lu,\"checkmates\":%lu}\n",
+                       stats.captures, stats.en_passants, stats.castles, stats.promotions,
+                       stats.checks, stats.discovered_checks, stats.double_checks, stats.checkmates);
+                return;
+        }
+
+        printf("Captures:          %lu\n", stats.captures);
+        printf("En-passants:       %lu\n", stats.en_passants);
+        printf("Castles:           %lu\n", stats.castles);
+        printf("Promotions:        %lu\n", stats.promotions);
+        printf("Checks:            %lu\n", stats.checks);
+        printf("Discovered checks: %lu\n", stats.discovered_checks);
+        printf("Double checks:     %lu\n", stats.double_checks);
+        printf("Checkmates:        %lu\n", stats.checkmates);
+}
+
+
+void print_usage(char const* program)
+{
+        fprintf(stderr,
+                "Usage: %s [options] <FEN> <depth>\n"
+                "       %s [options] --bench\n"
+                "       %s [options] --scaling\n"
+                "       %s [options] --microbench\n"
+                "       %s [options] --suite <file>\n"
+                "       %s [options] --coordinator <address> <FEN> <depth>\n"
+                "       %s [options] --worker <address>\n"
+                "       %s [options] --serve [address]\n\n"
+                " - FEN: position for perft test.\n"
+                " - depth: non-negative depth of perft test.\n\n"
+                "Options:\n"
+                " --hash <MiB>:    size of the shared transposition table (default: 0, disabled).\n"
+                " --divide:        print the node count of each root move as soon as it is finished.\n"
+                " --json:          print divide results as newline-delimited JSON, and bench results as a report.\n"
+                " --stats:         also count captures, en-passants, castles, promotions, checks and mates.\n"
+                " --suite <file>:  run all positions of an EPD perft suite (\";D1 20 ;D2 400\" per line).\n"
+                " --max-depth <n>: skip suite results deeper than n.\n"
+                " --coordinator <address>: hand out subtrees to workers, on host:port or unix:<path>.\n"
+                " --worker <address>:      count subtrees for the coordinator at the given address.\n"
+                " --serve [address]:       answer position/go perft commands on stdin, or from clients at the address.\n"
+                " --checkpoint <file>:     save the finished subtrees of the run every minute.\n"
+                " --resume:                skip the subtrees already finished in the checkpoint.\n"
+                " --progress:              print the progress and ETA of multi-threaded runs every second.\n"
+                " --affinity:              pin threads to physical cores first, then to their SMT siblings.\n"
+                " --numa-replicas:         pin threads, and copy the attack tables to each NUMA node.\n"
+                " --sliders <pext|magic>:  backend of sliding attacks (default: best for this cpu).\n"
+                " --counters:              print hardware performance counters per node in --bench, if available.\n"
+                " --threads <n>:           number of threads, or the most for --scaling (default: all cpus).\n"
+                " --warmup <n>:            untimed runs of each bench position (default: 0).\n"
+                " --repeat <n>:            timed runs of each bench position (default: 1).\n"
+                " --compare <file>:        flag significant regressions from an earlier --bench --json report.\n",
+                program, program, program, program, program, program, program, program);
+}
+
+
+constexpr Seconds CheckpointInterval = 60.0;
+
+
+// Parse a count given to an option, which must be at least the minimum.
+bool parse_count(char const* string, long minimum, size_t& count)
+{
+        char* end_of_count_string;
+        auto value = strtol(string, &end_of_count_string, 10);
+
+        if (value < minimum || *end_of_count_string || end_of_count_string == string) return false;
+
+        count = value;
+        return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+        char const* program = argv[0];
+        bool run_bench = false;
+        bool run_microbench = false;
+        bool run_scaling = false;
+        bool run_serve = false;
+        bool run_counters = false;
+        bool run_divide = false;
+        bool json = false;
+        bool run_stats = false;
+        char const* suite_path = nullptr;
+        Depth max_depth = ~0u;
+        char const* coordinator_address = nullptr;
+        char const* worker_address = nullptr;
+        char const* checkpoint_path = nullptr;
+        bool resume = false;
+        SliderBackend sliders = best_slider_backend();
+        size_t number_of_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (number_of_threads > MaximumThreads) number_of_threads = MaximumThreads;
+        size_t warmup = 0;
+        size_t repetitions = 1;
+        char const* baseline_path = nullptr;
+
+        // Parse options, leaving only the positional arguments.
+        while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+                if (strcmp(argv[1], "--bench") == 0) {
+                        run_bench = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--counters") == 0) {
+                        run_counters = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--threads") == 0 && argc > 2) {
+                        if (!parse_count(argv[2], 1, number_of_threads)) {
+                                fprintf(stderr, "error: invalid number of threads.\n");
+                                return 1;
+                        }
+
+                        if (number_of_threads > MaximumThreads) {
+                                fprintf(stderr, "error: at most %zu threads are supported.\n", MaximumThreads);
+                                return 1;
+                        }
+
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--warmup") == 0 && argc > 2) {
+                        if (!parse_count(argv[2], 0, warmup)) {
+                                fprintf(stderr, "error: invalid number of warmup runs.\n");
+                                return 1;
+                        }
+
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--repeat") == 0 && argc > 2) {
+                        if (!parse_count(argv[2], 1, repetitions)) {
+                                fprintf(stderr, "error: invalid number of repetitions.\n");
+                                return 1;
+                        }
+
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--compare") == 0 && argc > 2) {
+                        baseline_path = argv[2];
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--scaling") == 0) {
+                        run_scaling = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--microbench") == 0) {
+                        run_microbench = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--divide") == 0) {
+                        run_divide = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--json") == 0) {
+                        json = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--stats") == 0) {
+                        run_stats = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--hash") == 0 && argc > 2) {
+                        char* end_of_size_string;
+                        auto megabytes = strtol(argv[2], &end_of_size_string, 10);
+
+                        if (megabytes < 0 || *end_of_size_string) {
+                                fprintf(stderr, "error: invalid hash size.\n");
+                                return 1;
+                        }
+
+                        if (!resize_tt(megabytes)) {
+                                fprintf(stderr, "error: failed to allocate hash table.\n");
+                                return 1;
+                        }
+
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--suite") == 0 && argc > 2) {
+                        suite_path = argv[2];
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--max-depth") == 0 && argc > 2) {
+                        char* end_of_depth_string;
+                        auto depth = strtol(argv[2], &end_of_depth_string, 10);
+
+                        if (depth < 0 || *end_of_depth_string) {
+                                fprintf(stderr, "error: invalid depth.\n");
+                                return 1;
+                        }
+
+                        max_depth = depth;
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--coordinator") == 0 && argc > 2) {
+                        coordinator_address = argv[2];
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--checkpoint") == 0 && argc > 2) {
+                        checkpoint_path = argv[2];
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--sliders") == 0 && argc > 2) {
+                        if      (strcmp(argv[2], "pext")  == 0) sliders = PextSliders;
+                        else if (strcmp(argv[2], "magic") == 0) sliders = MagicSliders;
+
+                        else {
+                                fprintf(stderr, "error: unknown sliders %s, expected pext or magic.\n", argv[2]);
+                                return 1;
+                        }
+
+                        if (sliders == PextSliders && !__builtin_cpu_supports("bmi2")) {
+                                fprintf(stderr, "error: this cpu does not support pext.\n");
+                                return 1;
+                        }
+
+                        argc -= 2, argv += 2;
+                }
+
+                else if (strcmp(argv[1], "--affinity") == 0) {
+                        PinThreads = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--numa-replicas") == 0) {
+                        ReplicateAttackTables = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--progress") == 0) {
+                        ProgressInterval = 1.0;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--resume") == 0) {
+                        resume = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--serve") == 0) {
+                        run_serve = true;
+                        argc -= 1, argv += 1;
+                }
+
+                else if (strcmp(argv[1], "--worker") == 0 && argc > 2) {
+                        worker_address = argv[2];
+                        argc -= 2, argv += 2;
+                }
+
+                else {
+                        print_usage(program);
+                        return 1;
+                }
+        }
+
+        SelectedSliders = sliders;
+
+        // Only the bench reads the counters, scaling runs leave them out.
+        if (run_counters && (!run_bench || run_scaling)) {
+                fprintf(stderr, "error: --counters is only supported by --bench.\n");
+                return 1;
+        }
+
+        if (worker_address) {
+                if (argc != 1) {
+                        print_usage(program);
+                        return 1;
+                }
+
+                return run_worker(worker_address, number_of_threads) ? 0 : 1;
+        }
+
+        if (run_serve) {
+                if (argc > 2) {
+                        print_usage(program);
+                        return 1;
+                }
+
+                return run_server(argc == 2 ? argv[1] : nullptr, number_of_threads) ? 0 : 1;
+        }
+
+        if (suite_path) {
+                if (argc != 1) {
+                        print_usage(program);
+                        return 1;
+                }
+
+                return run_suite(suite_path, max_depth, number_of_threads) ? 0 : 1;
+        }
+
+        if (run_bench || run_scaling) {
+                if (argc != 1) {
+                        print_usage(program);
+                        return 1;
+                }
+
+                BenchOptions options = {
+                        .number_of_threads = number_of_threads,
+                        .warmup            = warmup,
+                        .repetitions       = repetitions,
+                        .json              = json,
+                        .counters          = run_counters,
+                        .baseline          = baseline_path,
+                };
+
+                if (run_scaling) return scaling(options) ? 0 : 1;
+                return bench(options) ? 0 : 1;
+        }
+
+        if (run_microbench) {
+                if (argc != 1) {
+                        print_usage(program);
+                        return 1;
+                }
+
+                char const* fens[NumberOfPerftTests];
+                for (size_t i = 0; i < NumberOfPerftTests; ++i) fens[i] = PerftTests[i].FEN;
+
+                microbench(fens, NumberOfPerftTests);
+                return 0;
+        }
+
+        if (argc != 3) {
+                print_usage(program);
+                return 1;
+        }
+
+        Board board;
+        FENInfo info;
+
+        auto error = parse_fen(argv[1], board, info);
+
+        if (error != FENOk) {
+                fprintf(stderr, "error: invalid fen: %s.\n", FENErrorMessages[error]);
+                return 1;
+        }
+
+        auto white_to_move = info.white_to_move;
+
+        char* end_of_depth_string;
+        auto depth = strtol(argv[2], &end_of_depth_string, 10);
+
+        if (depth < 0 || *end_of_depth_string) {
+                fprintf(stderr, "error: invalid depth.\n");
+                return 1;
+        }
+
+        if (run_divide) {
+                if (depth == 0) {
+                        fprintf(stderr, "error: divide requires a positive depth.\n");
+                        return 1;
+                }
+
+                if (!json) printf("Running multi-threaded perft divide on %zu threads.\n\n", number_of_threads);
+        }
+
+        // Checkpoints are only made of plain multi-threaded runs.
+        PerftJob job = { board, (Depth) depth };
+        PerftCheckpoint checkpoint = { .path = checkpoint_path, .interval = CheckpointInterval };
+
+        if (resume && !checkpoint_path) {
+                fprintf(stderr, "error: --resume requires --checkpoint <file>.\n");
+                return 1;
+        }
+
+        if (checkpoint_path && (run_divide || run_stats || coordinator_address)) {
+                fprintf(stderr, "error: checkpoints can't be combined with --divide, --stats or --coordinator.\n");
+                return 1;
+        }
+
+        // Runs of depth below 3 aren't multi-threaded, and are too short to need checkpoints.
+        if (checkpoint_path && depth < 3) {
+                fprintf(stderr, "error: checkpoints require a depth of at least 3.\n");
+                return 1;
+        }
+
+        Nodes resumed_nodes = 0; // not counted by this run
+
+        if (resume) {
+                if (!load_checkpoint(checkpoint, &job, 1)) return 1;
+
+                for (size_t i = 0; i < checkpoint.number_of_finished; ++i) resumed_nodes += checkpoint.finished_nodes[i];
+
+                if (checkpoint.number_of_finished) {
+                        printf("Resuming from %s, skipping %zu finished positions.\n", checkpoint_path, checkpoint.number_of_finished);
+                }
+        }
+
+        Nodes nodes;
+        MoveStatistics stats = {};
+        auto t1 = get_time_from_os();
+
+        if (run_divide) {
+                nodes = divide(board, white_to_move, depth, number_of_threads, json, run_stats ? &stats : nullptr);
+        }
+
+        else if (coordinator_address) {
+                if (!run_coordinator(coordinator_address, board, white_to_move, depth, nodes)) return 1;
+        }
+
+        else if (run_stats) {
+                nodes = threaded_perft(&job, 1, number_of_threads, nullptr, nullptr, &stats);
+        }
+
+        else if (depth < 3) {
+                if (!depth) nodes = 1; // definition of perft 1
+                else        nodes = perft(board, depth);
+        }
+
+        else if (checkpoint_path) {
+                printf("Running multi-threaded perft on %zu threads, checkpointing to %s.\n\n", number_of_threads, checkpoint_path);
+                nodes = threaded_perft(&job, 1, number_of_threads, nullptr, nullptr, nullptr, &checkpoint);
+                free_checkpoint(checkpoint);
+
+                if (checkpoint.failed) return 1;
+        }
+
+        else {
+                printf("Running multi-threaded perft on %zu threads.\n\n", number_of_threads);
+                nodes = threaded_perft(board, depth, number_of_threads);
+        }
+
+        auto t2 = get_time_from_os();
+
+        auto seconds = t2 - t1;
+        auto nodes_per_second = (nodes - resumed_nodes) / seconds;
+
+        if (json) {
+                if (run_stats) print_statistics(stats, json);
+                printf("{\"nodes\":%lu,\"seconds\":%.3f}\n", nodes, seconds);
+                return 0;
+        }
+
+        if (run_divide) printf("\n");
+
+        printf("Result:            %lu\n", nodes);
+        printf("Time taken:        %.3f seconds.\n", t2 - t1);
+
+        if (nodes_per_second < 1.0e9) printf("Nodes per second:  %.0f million.\n", nodes_per_second / 1.0e6);
+        else                          printf("Nodes per second:  %.3f billion.\n", nodes_per_second / 1.0e9);
+
+        if (run_stats) print_statistics(stats, json);
+        if (TT.enabled()) print_tt_stats();
+}
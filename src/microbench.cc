@@ -0,0 +1,353 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <x86intrin.h>
+
+#include "affinity.h"
+#include "board.h"
+#include "fen.h"
+#include "magic.h"
+#include "microbench.h"
+#include "movegen.h"
+#include "perft.h"
+
+/*
+ *   The corpus holds positions at plies 0 to 3 of each starting position, sampled evenly from all
+ *   positions at that ply, and a few of the moves and pawn pushes of each, to replay `make_move`
+ *   and `make_pawn_push`. It is small enough to stay in L2, so the primitives are measured without
+ *   the cache misses of a real search, but that is what makes the numbers stable.
+ *
+ *   One sample is a pass over the whole corpus. The samples of all primitives are taken in rounds,
+ *   in turn, so that a slow period of the machine affects all of them alike. The reported cost is
+ *   the median of all samples divided by the number of calls, which ignores the occasional interrupt
+ *   or context switch, and the deviation is that of the medians of each round, which shows how far
+ *   the result can be trusted.
+ */
+
+constexpr size_t CorpusPlies = 4;
+constexpr size_t PositionsPerPly = 64;
+constexpr size_t MovesPerPosition = 8;
+
+constexpr size_t MicrobenchRounds = 20;
+constexpr size_t SamplesPerRound = 50;
+constexpr size_t WarmupSamples = 5; // at the start of each round
+
+
+struct MicrobenchCorpus {
+        Board*              boards;
+        MoveGenerationInfo* infos; // of each board, ready for counting pawn moves
+        size_t              number_of_boards;
+
+        Board*  move_boards;
+        Move*   moves;
+        size_t  number_of_moves;
+
+        Board*  push_boards;
+        Square* pushes;
+        size_t  number_of_pushes;
+};
+
+struct MicrobenchKernel {
+        char const* name;
+        size_t MicrobenchCorpus::* calls; // per pass over the corpus
+        void (*run)(MicrobenchCorpus const& corpus);
+};
+
+
+// Keep the compiler from optimising away a result, or the stores that produced it.
+template <typename T>
+inline void keep(T const& value)
+{
+        asm volatile ("" : : "r" (&value) : "memory");
+}
+
+
+inline uint64_t start_timer()
+{
+        _mm_lfence(); // wait for earlier instructions to finish before reading the TSC...
+        auto ticks = __rdtsc();
+        _mm_lfence(); // ... and for it to be read before starting the timed work
+        return ticks;
+}
+
+inline uint64_t stop_timer()
+{
+        unsigned processor;
+        auto ticks = __rdtscp(&processor); // waits for the timed work to finish
+        _mm_lfence();
+        return ticks;
+}
+
+
+int compare_ticks(void const* a, void const* b)
+{
+        auto p = *(uint64_t const*) a;
+        auto q = *(uint64_t const*) b;
+        return (p > q) - (p < q);
+}
+
+
+void add_children(Board const& board, Board* children, size_t& number_of_children)
+{
+        visit_children(board, [&](Board const& child) { children[number_of_children++] = child; });
+}
+
+
+// Add a position of the corpus, with up to `MovesPerPosition` of its moves and pawn pushes.
+void add_to_corpus(MicrobenchCorpus& corpus, Board const& board)
+{
+        corpus.boards[corpus.number_of_boards++] = board;
+
+        auto buffer = generate_moves(board);
+        auto step = buffer.size / MovesPerPosition + 1;
+
+        for (size_t i = 0; i < buffer.size; i += step) {
+                corpus.move_boards[corpus.number_of_moves] = board;
+                corpus.moves[corpus.number_of_moves++] = buffer.moves[i];
+        }
+
+        for (size_t i = 0; buffer.pawn_pushes && i < MovesPerPosition; ++i) {
+                corpus.push_boards[corpus.number_of_pushes] = board;
+                corpus.pushes[corpus.number_of_pushes++] = trailing_zeros_and_pop(buffer.pawn_pushes);
+        }
+}
+
+
+bool build_corpus(MicrobenchCorpus& corpus, char const* const fens[], size_t number_of_fens)
+{
+        auto capacity = number_of_fens * CorpusPlies * PositionsPerPly;
+
+        corpus = {
+                .boards           = new Board[capacity],
+                .infos            = new MoveGenerationInfo[capacity],
+                .number_of_boards = 0,
+                .move_boards      = new Board[capacity * MovesPerPosition],
+                .moves            = new Move[capacity * MovesPerPosition],
+                .number_of_moves  = 0,
+                .push_boards      = new Board[capacity * MovesPerPosition],
+                .pushes           = new Square[capacity * MovesPerPosition],
+                .number_of_pushes = 0,
+        };
+
+        for (size_t index = 0; index < number_of_fens; ++index) {
+                Board root;
+                FENInfo info;
+
+                auto error = parse_fen(fens[index], root, info);
+
+                if (error != FENOk) {
+                        fprintf(stderr, "error: invalid fen %s: %s.\n", fens[index], FENErrorMessages[error]);
+                        return false;
+                }
+
+                Board* level = new Board[1] { root };
+                size_t level_size = 1;
+
+                for (size_t ply = 0; ply < CorpusPlies; ++ply) {
+                        auto step = level_size / PositionsPerPly + 1;
+                        for (size_t i = 0; i < level_size; i += step) add_to_corpus(corpus, level[i]);
+
+                        if (ply + 1 == CorpusPlies) break;
+
+                        // Expand the next ply, counting its positions first.
+                        size_t next_size = 0;
+
+                        for (size_t i = 0; i < level_size; ++i) {
+                                auto buffer = generate_moves(level[i]);
+                                next_size += buffer.size + popcount(buffer.pawn_pushes);
+                        }
+
+                        auto next = new Board[next_size];
+                        next_size = 0;
+
+                        for (size_t i = 0; i < level_size; ++i) add_children(level[i], next, next_size);
+
+                        delete[] level;
+                        level = next;
+                        level_size = next_size;
+                }
+
+                delete[] level;
+        }
+
+        return true;
+}
+
+
+void free_corpus(MicrobenchCorpus& corpus)
+{
+        delete[] corpus.boards;
+        delete[] corpus.infos;
+        delete[] corpus.move_boards;
+        delete[] corpus.moves;
+        delete[] corpus.push_boards;
+        delete[] corpus.pushes;
+}
+
+
+// The kernels make one pass over the corpus each.
+
+template <SliderBackend Sliders>
+void bench_movegen_info(MicrobenchCorpus const& corpus)
+{
+        for (size_t i = 0; i < corpus.number_of_boards; ++i) {
+                MoveGenerationInfo info;
+                auto checks = generate_movegen_info<Sliders>(corpus.boards[i], info);
+                keep(info), keep(checks);
+        }
+}
+
+template <SliderBackend Sliders>
+void bench_count_pawn_moves(MicrobenchCorpus const& corpus)
+{
+        uint64_t total = 0;
+        for (size_t i = 0; i < corpus.number_of_boards; ++i) total += count_pawn_moves<Sliders>(corpus.boards[i], corpus.infos[i]);
+        keep(total);
+}
+
+template <SliderBackend Sliders>
+void bench_count_moves(MicrobenchCorpus const& corpus)
+{
+        uint64_t total = 0;
+        for (size_t i = 0; i < corpus.number_of_boards; ++i) total += count_moves<Sliders>(corpus.boards[i]);
+        keep(total);
+}
+
+template <SliderBackend Sliders>
+void bench_generate_moves(MicrobenchCorpus const& corpus)
+{
+        for (size_t i = 0; i < corpus.number_of_boards; ++i) {
+                auto buffer = generate_moves<Sliders>(corpus.boards[i]);
+                keep(buffer);
+        }
+}
+
+// The same moves passed to a visitor, without storing them.
+template <SliderBackend Sliders>
+void bench_visit_moves(MicrobenchCorpus const& corpus)
+{
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < corpus.number_of_boards; ++i) {
+                visit_moves<Sliders>(corpus.boards[i], [&](Move move) { total += move; },
+                                                       [&](BitBoard pawn_pushes) { total += pawn_pushes; });
+        }
+
+        keep(total);
+}
+
+void bench_make_move(MicrobenchCorpus const& corpus)
+{
+        for (size_t i = 0; i < corpus.number_of_moves; ++i) {
+                auto child = make_move(corpus.move_boards[i], corpus.moves[i]);
+                keep(child);
+        }
+}
+
+void bench_make_pawn_push(MicrobenchCorpus const& corpus)
+{
+        for (size_t i = 0; i < corpus.number_of_pushes; ++i) {
+                auto child = make_pawn_push(corpus.push_boards[i], corpus.pushes[i]);
+                keep(child);
+        }
+}
+
+
+template <SliderBackend Sliders>
+constexpr MicrobenchKernel MicrobenchKernels[] = {
+        { "generate_movegen_info", &MicrobenchCorpus::number_of_boards, bench_movegen_info<Sliders> },
+        { "count_pawn_moves",      &MicrobenchCorpus::number_of_boards, bench_count_pawn_moves<Sliders> },
+        { "count_moves",           &MicrobenchCorpus::number_of_boards, bench_count_moves<Sliders> },
+        { "generate_moves",        &MicrobenchCorpus::number_of_boards, bench_generate_moves<Sliders> },
+        { "visit_moves",           &MicrobenchCorpus::number_of_boards, bench_visit_moves<Sliders> },
+        { "make_move",             &MicrobenchCorpus::number_of_moves,  bench_make_move },
+        { "make_pawn_push",        &MicrobenchCorpus::number_of_pushes, bench_make_pawn_push },
+};
+
+constexpr size_t NumberOfMicrobenchKernels = sizeof(MicrobenchKernels<PextSliders>) / sizeof(MicrobenchKernel);
+
+
+double median_ticks(uint64_t samples[], size_t number_of_samples)
+{
+        qsort(samples, number_of_samples, sizeof(uint64_t), compare_ticks);
+        return samples[number_of_samples / 2];
+}
+
+
+template <SliderBackend Sliders>
+void run_microbenchmarks(MicrobenchCorpus& corpus)
+{
+        auto& kernels = MicrobenchKernels<Sliders>;
+
+        // Counting pawn moves needs the targets to be restricted by checks first, as in count_moves.
+        for (size_t i = 0; i < corpus.number_of_boards; ++i) {
+                auto& info = corpus.infos[i];
+                auto checks = generate_movegen_info<Sliders>(corpus.boards[i], info);
+                if (popcount(checks) == 1) info.targets &= LineBetween[info.king][trailing_zeros(checks)];
+        }
+
+        static uint64_t samples[NumberOfMicrobenchKernels][MicrobenchRounds * SamplesPerRound];
+        static double round_medians[NumberOfMicrobenchKernels][MicrobenchRounds];
+
+        // Calibrate the TSC against the wall clock over the whole run.
+        auto start_time = get_time_from_os();
+        auto start_ticks = start_timer();
+
+        for (size_t round = 0; round < MicrobenchRounds; ++round) {
+                for (size_t k = 0; k < NumberOfMicrobenchKernels; ++k) {
+                        auto round_samples = samples[k] + round * SamplesPerRound;
+
+                        for (size_t i = 0; i < WarmupSamples; ++i) kernels[k].run(corpus);
+
+                        for (size_t i = 0; i < SamplesPerRound; ++i) {
+                                auto start = start_timer();
+                                kernels[k].run(corpus);
+                                round_samples[i] = stop_timer() - start;
+                        }
+
+                        round_medians[k][round] = median_ticks(round_samples, SamplesPerRound);
+                }
+        }
+
+        auto ticks_per_ns = (stop_timer() - start_ticks) / ((get_time_from_os() - start_time) * 1.0e9);
+
+        printf("primitive                 ticks/call       min     ns/call   deviation\n");
+        printf("====================================================================\n");
+
+        for (size_t k = 0; k < NumberOfMicrobenchKernels; ++k) {
+                auto calls = corpus.*kernels[k].calls;
+
+                double mean = 0.0, variance = 0.0;
+
+                for (auto median : round_medians[k]) mean += median;
+                mean /= MicrobenchRounds;
+
+                for (auto median : round_medians[k]) variance += (median - mean) * (median - mean);
+                variance /= MicrobenchRounds - 1;
+
+                auto median = median_ticks(samples[k], MicrobenchRounds * SamplesPerRound) / calls;
+                auto minimum = (double) samples[k][0] / calls; // sorted by median_ticks
+
+                printf("%-25s %10.2f %9.2f %11.2f %10.2f%%\n", kernels[k].name, median, minimum,
+                       median / ticks_per_ns, 100.0 * sqrt(variance) / mean);
+        }
+}
+
+
+void microbench(char const* const fens[], size_t number_of_fens)
+{
+        MicrobenchCorpus corpus;
+        if (!build_corpus(corpus, fens, number_of_fens)) return;
+
+        place_thread(0); // only pins if asked to
+
+        printf("Microbenchmarks on %zu positions, %zu moves and %zu pawn pushes (%s sliders).\n\n",
+               corpus.number_of_boards, corpus.number_of_moves, corpus.number_of_pushes,
+               SelectedSliders == PextSliders ? "pext" : "magic");
+
+        if (SelectedSliders == PextSliders) run_microbenchmarks<PextSliders>(corpus);
+        else run_microbenchmarks<MagicSliders>(corpus);
+
+        free_corpus(corpus);
+}
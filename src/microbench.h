@@ -0,0 +1,14 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ *   Microbenchmarks of the primitives of move generation, to see which of them a change sped up
+ *   or slowed down, which `--bench` can't tell. Each primitive is replayed over the same corpus of
+ *   positions, sampled from the first few plies of the given positions.
+ *
+ *   The cost per call is given in TSC ticks, fenced so that the timed work can't be reordered
+ *   around them, and in nanoseconds. The TSC ticks at a constant rate rather than the core clock,
+ *   so for the most stable results fix the CPU frequency and pin the thread with `--affinity`.
+ */
+
+void microbench(char const* const fens[], size_t number_of_fens);
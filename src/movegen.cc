@@ -2,201 +2,10 @@
 #include "board.h"
 #include "magic.h"
 #include "movegen.h"
-
-/*
- *   Information that is passed around to move generation functions.
- *   It stores (in order of definition):
- *
- *   - all squares attacked by enemy pieces to prevent illegal king walks
- *   - all squares piece *must* move to, this is to block checks, or capture checking
- *     pieces, etc...
- *   - all squares that are pinned diagonally (see brackets below)
- *   - all squares that are pinned orthogonally (not necessarily our or even occupied)
- *   - square that our king is on
- */
-
-struct MoveGenerationInfo {
-        BitBoard attacked;
-        BitBoard targets;
-        BitBoard pinned_diagonally;
-        BitBoard pinned_orthogonally;
-        Square   king;
-};
-
-
-// Generate pawn moves from a move mask, from a given direction. This allows us to
-// generate in more predictable loops.
-
-void partially_generate_pawn_moves(MoveBuffer& buffer, BitBoard moves, Square direction, bool promotion)
-{
-        while (moves) {
-                auto dest = trailing_zeros_and_pop(moves);
-                auto init = dest - direction;
-
-                if (promotion) {
-                        buffer.push(M(init, dest, Knight));
-                        buffer.push(M(init, dest, Bishop));
-                        buffer.push(M(init, dest, Rook));
-                        buffer.push(M(init, dest, Queen));
-                }
-
-                else {
-                        buffer.push(M(init, dest, Pawn));
-                }
-        }
-}
-
-
-void generate_pawn_moves(MoveBuffer& buffer, Board const& board, MoveGenerationInfo const& info)
-{
-        auto pawns   = board.extract_by_piece(Pawn) & board.our;
-        auto occ     = board.occupied();
-        auto enemy   = occ &~ board.our;
-        auto targets = info.targets;
-
-        auto en_passant = board.en_passant();
-        auto candidates = pawns & south(east(en_passant) | west(en_passant));
-
-        // Check for pinned en-passant. Note that this is a special type of pinned piece as two
-        // pieces dissappear in the checking direction. This introduces a slow branch into our pawn
-        // move generation, but it is a necessary evil for full legality, however rare. We optimise this
-        // branch by only checking if the king is actually on the 5th rank.
-
-        if (info.king / 8 == 4 && popcount(candidates) == 1) {
-                auto pinners = (board.extract_by_piece(Rook) | board.extract_by_piece(Queen)) &~ board.our;
-                auto clear = candidates | south(en_passant);
-
-                // If the pawn is "double" pinned, then en-passant is no longer possible
-                if (RookMagics[info.king].attacks(occ &~ clear) & pinners)
-                        en_passant = 0;
-        }
-
-        // Enable en-passant if the pawn being captured was giving check.
-        targets |= en_passant & north(info.targets);
-        enemy   |= en_passant;
-
-        auto pinned = info.pinned_diagonally | info.pinned_orthogonally;
-        auto unpinned_pawns = pawns &~ pinned;
-
-        // The only pinned pawns that can move foward are on same file as our king.
-        auto file = file_of(info.king);
-        auto forward = unpinned_pawns | (pawns & info.pinned_orthogonally & file);
-
-        auto single_move = north(forward) &~ occ;
-        auto double_move = north(single_move & Rank3BB) &~ occ;
-
-        auto east_capture = north(east(unpinned_pawns)) & enemy;
-        auto west_capture = north(west(unpinned_pawns)) & enemy;
-
-        // Again as with foward, we constrain pinned pawns capturing to staying diagonal to the king.
-        // This is a sufficient condition for legality.
-        auto pinned_east_capture = north(east(pawns & info.pinned_diagonally)) & enemy & info.pinned_diagonally;
-        auto pinned_west_capture = north(west(pawns & info.pinned_diagonally)) & enemy & info.pinned_diagonally;
-
-        single_move  = single_move & targets;
-        double_move  = double_move & targets;
-        east_capture = (east_capture | pinned_east_capture) & targets;
-        west_capture = (west_capture | pinned_west_capture) & targets;
-
-        buffer.pawn_pushes = (single_move &~ Rank8BB) | double_move;
-
-        // Handle promotions, note that double pawn moves cannot promote.
-        partially_generate_pawn_moves(buffer, single_move  & Rank8BB, North,   true);
-        partially_generate_pawn_moves(buffer, east_capture & Rank8BB, North+East, true);
-        partially_generate_pawn_moves(buffer, west_capture & Rank8BB, North+West, true);
-
-        partially_generate_pawn_moves(buffer, east_capture &~ Rank8BB, North+East, false);
-        partially_generate_pawn_moves(buffer, west_capture &~ Rank8BB, North+West, false);
-}
-
-
-BitBoard generic_attacks(PieceType piece, Square sq, BitBoard occ)
-{
-        switch (piece) {
-                case Knight: return KnightAttacks[sq];
-                case Bishop: return BishopMagics[sq].attacks(occ);
-                case Rook:   return RookMagics[sq].attacks(occ);
-                case Queen:  return BishopMagics[sq].attacks(occ)
-                                  | RookMagics[sq].attacks(occ);
-                default: __builtin_unreachable();
-        }
-}
-
-
-void generate_piece_moves(MoveBuffer& buffer, Board const& board, MoveGenerationInfo const& info, PieceType piece)
-{
-        auto pinned = info.pinned_diagonally | info.pinned_orthogonally;
-        auto pieces = board.extract_by_piece(piece) & board.our &~ pinned;
-
-        while (pieces) {
-                auto init = trailing_zeros_and_pop(pieces);
-                auto attacks = generic_attacks(piece, init, board.occupied()) & info.targets;
-
-                while (attacks) {
-                        auto dest = trailing_zeros_and_pop(attacks);
-                        buffer.push(M(init, dest, piece));
-                }
-        }
-}
-
-
-void generate_pinned_piece_moves(MoveBuffer& buffer, Board const& board, MoveGenerationInfo const& info, PieceType moves_like)
-{
-        auto pinned = (moves_like == Bishop) ? info.pinned_diagonally : info.pinned_orthogonally;
-
-        auto pieces = board.extract_by_piece(moves_like);
-        auto queens = board.extract_by_piece(Queen);
-
-        pieces |= queens;
-        pieces &= board.our & pinned;
-
-        while (pieces) {
-                auto init = trailing_zeros_and_pop(pieces);
-
-                // As with pinned pawns, as long as the moves stay on a square that is pinned, then it is
-                // enough to satisfy legality. Note that for this to hold orthogonal and diagonal pins are
-                // separated.
-
-                auto attacks = generic_attacks(moves_like, init, board.occupied()) & info.targets & pinned;
-                auto actual_piece = (queens & (OneBB << init)) ? Queen : moves_like;
-
-                while (attacks) {
-                        auto dest = trailing_zeros_and_pop(attacks);
-                        buffer.push(M(init, dest, actual_piece));
-                }
-        }
-}
-
-
-void generate_king_moves(MoveBuffer& buffer, Board const& board, MoveGenerationInfo const& info)
-{
-        auto attacks = KingAttacks[info.king] & info.targets;
-        attacks &= ~info.attacked;
-
-        while (attacks) {
-                auto dest = trailing_zeros_and_pop(attacks);
-                buffer.push(M(info.king, dest, King));
-        }
-
-        // If our king is not on E1, it must have moved, so castling of any kind is no longer possible.
-        // So we safely can optimise with an early return.
-        if (info.king != E1) return;
-
-        // Get a mask of rooks we can castle with, and that there are no occupied squares between our
-        // king and that rook.
-        auto castling = board.extract_by_piece(Castle)
-                      & RookMagics[info.king].attacks(board.occupied());
-
-        // We also then check that none of the squares between the king and the rook, including the
-        // king's square itself, are attacked. Note that castling our of check is illegal.
-        constexpr auto QueensideInbetween = (OneBB << C1 | OneBB << D1 | OneBB << E1);
-        constexpr auto KingsideInbetween = (OneBB << E1 | OneBB << F1 | OneBB << G1);
-
-        if (castling & (OneBB << A1) && !(QueensideInbetween & info.attacked)) buffer.push(M_CASTLING(C1));
-        if (castling & (OneBB << H1) && !(KingsideInbetween & info.attacked))  buffer.push(M_CASTLING(G1));
-}
+#include "zobrist.h"
 
 
+template <SliderBackend Sliders>
 BitBoard generate_movegen_info(Board const& board, MoveGenerationInfo& info)
 {
         // We cannot capture our own pieces!
@@ -226,8 +35,8 @@ BitBoard generate_movegen_info(Board const& board, MoveGenerationInfo& info)
         auto occ = board.occupied() &~ our_king;
         auto blockers = occ & board.our;
 
-        auto king_diagonals = BishopMagics[info.king].attacks(occ);
-        auto king_orthogonals = RookMagics[info.king].attacks(occ);
+        auto king_diagonals = BishopMagics[info.king].attacks<Sliders>(occ);
+        auto king_orthogonals = RookMagics[info.king].attacks<Sliders>(occ);
 
         // Generate all pieces that are putting our king in check.
         checks |= pawns & north(east(our_king) | west(our_king));
@@ -251,11 +60,11 @@ BitBoard generate_movegen_info(Board const& board, MoveGenerationInfo& info)
 
         // Get all bishops, rooks and queens that are x-raying our king. Note we calculate this before
         // finding the attacked squares of these piece types below as that would destroy these bitboards.
-        auto bishop_pins = bishops & BishopMagics[info.king].attacks(remove_blockers);
-        auto rook_pins = rooks & RookMagics[info.king].attacks(remove_blockers);
+        auto bishop_pins = bishops & BishopMagics[info.king].attacks<Sliders>(remove_blockers);
+        auto rook_pins = rooks & RookMagics[info.king].attacks<Sliders>(remove_blockers);
 
-        while (bishops) attacked |= BishopMagics[trailing_zeros_and_pop(bishops)].attacks(occ);
-        while (rooks)   attacked |= RookMagics[trailing_zeros_and_pop(rooks)].attacks(occ);
+        while (bishops) attacked |= BishopMagics[trailing_zeros_and_pop(bishops)].attacks<Sliders>(occ);
+        while (rooks)   attacked |= RookMagics[trailing_zeros_and_pop(rooks)].attacks<Sliders>(occ);
 
         info.attacked = attacked;
 
@@ -272,40 +81,19 @@ BitBoard generate_movegen_info(Board const& board, MoveGenerationInfo& info)
 }
 
 
-// Generate all legal moves for a given position. It is assumed that board itself is a legal
-// position, otherwise UB may occur (assumptions that we have a king may no longer be true).
-
+// Store the moves for callers that iterate them more than once, or need them all at once.
+template <SliderBackend Sliders>
 MoveBuffer generate_moves(Board const& board)
 {
         MoveBuffer buffer; // unitialised for performance
-        MoveGenerationInfo info;
-
-        // Initialise buffer. Note that pawn_pushes must be zeroed in case of an early exit,
-        // caused by double check, and pawn moves aren't generated.
         buffer.size = 0;
-        buffer.pawn_pushes = 0;
-
-        auto checks = generate_movegen_info(board, info);
-        generate_king_moves(buffer, board, info);
-
-        // If we are in check from more than one piece, then we can only move king otherwise
-        // we must block the check, or capture the checking piece
-        if (popcount(checks) > 1) return buffer;
-        if (checks) info.targets &= LineBetween[info.king][trailing_zeros(checks)];
 
-        generate_pawn_moves(buffer, board, info);
-
-        // Generate regular moves for non-pinned pieces
-        generate_piece_moves(buffer, board, info, Knight);
-        generate_piece_moves(buffer, board, info, Bishop);
-        generate_piece_moves(buffer, board, info, Rook);
-        generate_piece_moves(buffer, board, info, Queen);
+        // Note that pawn_pushes must be zeroed in case of an early exit caused by double check,
+        // where pawn moves aren't generated.
+        buffer.pawn_pushes = 0;
 
-        // Generate moves of pinned pieces, note: pinned knights can never move
-        if ((info.pinned_orthogonally | info.pinned_diagonally) & board.our) {
-                generate_pinned_piece_moves(buffer, board, info, Bishop);
-                generate_pinned_piece_moves(buffer, board, info, Rook);
-        }
+        visit_moves<Sliders>(board, [&](Move move) { buffer.push(move); },
+                                    [&](BitBoard pawn_pushes) { buffer.pawn_pushes = pawn_pushes; });
 
         return buffer;
 }
@@ -333,6 +121,43 @@ Board make_move(Board board, Move move)
         // the move has been made.
         auto enemy = board.occupied() &~ (board.our | clear);
 
+#ifdef PERFT_INCREMENTAL_KEY
+        // Update the key before the board is modified, as we need to know the pieces being
+        // removed. Any en-passant square always disappears after a move.
+        auto key = board.key;
+        auto en_passant = board.en_passant();
+
+        if (en_passant) key ^= zobrist(Empty, trailing_zeros(en_passant), true);
+
+        // Remove captured pieces, including an en-passant pawn (always directly south of dest).
+        auto captured = board.occupied() & clear &~ board.our;
+
+        while (captured) {
+                auto sq = trailing_zeros_and_pop(captured);
+                key ^= zobrist(board.piece_on(sq), sq, false);
+        }
+
+        // Move the piece, which may change its type (promotions, and castles decaying to rooks).
+        key ^= zobrist(board.piece_on(init), init, true);
+        key ^= zobrist(piece, dest, true);
+
+        if (piece == King) {
+                auto castles = board.extract_by_piece(Castle) & Rank1BB;
+
+                while (castles) {
+                        auto sq = trailing_zeros_and_pop(castles);
+                        key ^= zobrist(Castle, sq, true) ^ zobrist(Rook, sq, true);
+                }
+        }
+
+        if (move & M_CASTLING_MASK) {
+                Square rook = (dest < init) ? A1 : H1;
+                key ^= zobrist(Rook, rook, true) ^ zobrist(Rook, (dest + init) / 2, true);
+        }
+
+        board.key = rotate_key(key);
+#endif
+
         // When the king moves for the first time, all castling is no longer allowed.
         if (piece == King) {
                 static_assert(Rook   == 0b100, "required bit pattern");
@@ -391,6 +216,19 @@ Board make_pawn_push(Board board, Square dest)
                 init_bitboard = south(init_bitboard);
         }
 
+#ifdef PERFT_INCREMENTAL_KEY
+        auto key = board.key;
+        auto en_passant = board.en_passant();
+
+        if (en_passant) key ^= zobrist(Empty, trailing_zeros(en_passant), true);
+        if (enemy &~ occupied) key ^= zobrist(Empty, dest + South, false);
+
+        key ^= zobrist(Pawn, trailing_zeros(init_bitboard), true);
+        key ^= zobrist(Pawn, dest, true);
+
+        board.key = rotate_key(key);
+#endif
+
         static_assert(Pawn == 0b001, "required bit pattern");
         board.x ^= (dest_bitboard | init_bitboard); // toggle pawns
 
@@ -410,6 +248,7 @@ Board make_pawn_push(Board board, Square dest)
  */
 
 
+template <SliderBackend Sliders>
 uint64_t count_pawn_moves(Board const& board, MoveGenerationInfo const& info)
 {
         auto pawns   = board.extract_by_piece(Pawn) & board.our;
@@ -430,7 +269,7 @@ uint64_t count_pawn_moves(Board const& board, MoveGenerationInfo const& info)
                 auto clear = candidates | south(en_passant);
 
                 // If the pawn is "double" pinned, then en-passant is no longer possible
-                if (RookMagics[info.king].attacks(occ &~ clear) & pinners)
+                if (RookMagics[info.king].attacks<Sliders>(occ &~ clear) & pinners)
                         en_passant = 0;
         }
 
@@ -468,6 +307,7 @@ uint64_t count_pawn_moves(Board const& board, MoveGenerationInfo const& info)
 }
 
 
+template <SliderBackend Sliders>
 uint64_t count_piece_moves(Board const& board, MoveGenerationInfo const& info, PieceType piece)
 {
         auto pinned = info.pinned_diagonally | info.pinned_orthogonally;
@@ -477,7 +317,7 @@ uint64_t count_piece_moves(Board const& board, MoveGenerationInfo const& info, P
 
         while (pieces) {
                 auto init = trailing_zeros_and_pop(pieces);
-                auto attacks = generic_attacks(piece, init, board.occupied()) & info.targets;
+                auto attacks = generic_attacks<Sliders>(piece, init, board.occupied()) & info.targets;
                 count += popcount(attacks);
         }
 
@@ -485,6 +325,7 @@ uint64_t count_piece_moves(Board const& board, MoveGenerationInfo const& info, P
 }
 
 
+template <SliderBackend Sliders>
 uint64_t count_pinned_piece_moves(Board const& board, MoveGenerationInfo const& info, PieceType moves_like)
 {
         auto pinned = (moves_like == Bishop) ? info.pinned_diagonally : info.pinned_orthogonally;
@@ -499,7 +340,7 @@ uint64_t count_pinned_piece_moves(Board const& board, MoveGenerationInfo const&
 
         while (pieces) {
                 auto init = trailing_zeros_and_pop(pieces);
-                auto attacks = generic_attacks(moves_like, init, board.occupied()) & info.targets;
+                auto attacks = generic_attacks<Sliders>(moves_like, init, board.occupied()) & info.targets;
 
                 attacks &= pinned;
                 count += popcount(attacks);
@@ -509,6 +350,7 @@ uint64_t count_pinned_piece_moves(Board const& board, MoveGenerationInfo const&
 }
 
 
+template <SliderBackend Sliders>
 uint64_t count_king_moves(Board const& board, MoveGenerationInfo const& info)
 {
         auto attacks = KingAttacks[info.king] & info.targets;
@@ -518,7 +360,7 @@ uint64_t count_king_moves(Board const& board, MoveGenerationInfo const& info)
         if (info.king != E1) return count;
 
         auto castling = board.extract_by_piece(Castle)
-                      & RookMagics[info.king].attacks(board.occupied());
+                      & RookMagics[info.king].attacks<Sliders>(board.occupied());
 
         constexpr auto QueensideInbetween = (OneBB << C1 | OneBB << D1 | OneBB << E1);
         constexpr auto KingsideInbetween = (OneBB << E1 | OneBB << F1 | OneBB << G1);
@@ -530,26 +372,237 @@ uint64_t count_king_moves(Board const& board, MoveGenerationInfo const& info)
 }
 
 
-uint64_t count_moves(Board const& board)
+template <SliderBackend Sliders>
+inline uint64_t count_moves_with_info(Board const& board, MoveGenerationInfo& info, BitBoard checks)
 {
-        MoveGenerationInfo info;
-
-        auto checks = generate_movegen_info(board, info);
-        uint64_t count = count_king_moves(board, info);
+        uint64_t count = count_king_moves<Sliders>(board, info);
 
         if (popcount(checks) > 1) return count;
         if (checks) info.targets &= LineBetween[info.king][trailing_zeros(checks)];
 
         if ((info.pinned_orthogonally | info.pinned_diagonally) & board.our) {
-                count += count_pinned_piece_moves(board, info, Bishop);
-                count += count_pinned_piece_moves(board, info, Rook);
+                count += count_pinned_piece_moves<Sliders>(board, info, Bishop);
+                count += count_pinned_piece_moves<Sliders>(board, info, Rook);
+        }
+
+        count += count_pawn_moves<Sliders> (board, info);
+        count += count_piece_moves<Sliders>(board, info, Knight);
+        count += count_piece_moves<Sliders>(board, info, Bishop);
+        count += count_piece_moves<Sliders>(board, info, Rook);
+        count += count_piece_moves<Sliders>(board, info, Queen);
+
+        return count;
+}
+
+
+template <SliderBackend Sliders>
+uint64_t count_moves(Board const& board)
+{
+        MoveGenerationInfo info;
+
+        auto checks = generate_movegen_info<Sliders>(board, info);
+        return count_moves_with_info<Sliders>(board, info, checks);
+}
+
+
+/*
+ *   Dedicated kernel for perft at depth 2. All children of a node share the opponent's king, and
+ *   most moves don't touch any of the lines (diagonals and orthogonals) through it. For those moves
+ *   the opponent's pins are exactly the same in every child, and none of our sliders can give check,
+ *   so the king rays and pins are only computed once per node, and each child only has to generate
+ *   the squares we attack and the checks by pawns and knights.
+ */
+
+// Same as generate_movegen_info, but without the king rays and pins which are already known.
+template <SliderBackend Sliders>
+BitBoard generate_attacked_info(Board const& board, MoveGenerationInfo& info)
+{
+        info.targets = ~(board.occupied() & board.our);
+
+        auto pawns   = board.extract_by_piece(Pawn)   &~ board.our;
+        auto knights = board.extract_by_piece(Knight) &~ board.our;
+        auto bishops = board.extract_by_piece(Bishop) &~ board.our;
+        auto rooks   = board.extract_by_piece(Rook )  &~ board.our;
+        auto queens  = board.extract_by_piece(Queen)  &~ board.our;
+        auto king    = board.extract_by_piece(King )  &~ board.our;
+
+        bishops |= queens;
+        rooks   |= queens;
+
+        auto our_king = OneBB << info.king;
+        auto occ = board.occupied() &~ our_king;
+
+        auto checks = (pawns & north(east(our_king) | west(our_king)))
+                    | (knights & KnightAttacks[info.king]);
+
+        auto attacked = south(east(pawns) | west(pawns)) | KingAttacks[trailing_zeros(king)];
+
+        while (knights) {
+                attacked |= KnightAttacks[trailing_zeros_and_pop(knights)];
+                attacked |= KnightAttacks[trailing_zeros_and_pop(knights)];
         }
 
-        count += count_pawn_moves (board, info);
-        count += count_piece_moves(board, info, Knight);
-        count += count_piece_moves(board, info, Bishop);
-        count += count_piece_moves(board, info, Rook);
-        count += count_piece_moves(board, info, Queen);
+        while (bishops) attacked |= BishopMagics[trailing_zeros_and_pop(bishops)].attacks<Sliders>(occ);
+        while (rooks)   attacked |= RookMagics[trailing_zeros_and_pop(rooks)].attacks<Sliders>(occ);
+
+        info.attacked = attacked;
+        return checks;
+}
+
+
+template <SliderBackend Sliders>
+uint64_t perft2(Board const& board)
+{
+        // The opponent's info in a child where nothing moved, as seen from the opponent's perspective.
+        Board unmoved = {
+                .x = rotate(board.x),
+                .y = rotate(board.y),
+                .z = rotate(board.z),
+                .our = rotate(board.occupied() &~ board.our),
+        };
+
+        MoveGenerationInfo shared;
+        generate_movegen_info<Sliders>(unmoved, shared);
+
+        // Lines through the opponent's king, from our perspective.
+        Square king = shared.king ^ 56;
+        auto lines = BishopMagics[king].attacks<Sliders>(0) | RookMagics[king].attacks<Sliders>(0);
+
+        auto en_passant = board.en_passant();
+        uint64_t count = 0;
+
+        auto count_child = [&](Board const& child, BitBoard touched) {
+                if (touched & lines) return count_moves<Sliders>(child);
+
+                auto info = shared;
+                auto checks = generate_attacked_info<Sliders>(child, info);
+
+                return count_moves_with_info<Sliders>(child, info, checks);
+        };
+
+        auto visit_move = [&](Move move) {
+                auto touched = OneBB << M_INIT(move) | OneBB << M_DEST(move);
+
+                // En-passant also removes the captured pawn, and castling moves a rook along our first
+                // rank, so these always take the slow path.
+                if (move & M_CASTLING_MASK) touched = lines;
+                if (touched & en_passant && M_PIECE(move) == Pawn) touched = lines;
+
+                count += count_child(make_move(board, move), touched);
+        };
+
+        auto visit_pawn_pushes = [&](BitBoard pawn_pushes) {
+                while (pawn_pushes) {
+                        auto dest = trailing_zeros_and_pop(pawn_pushes);
+                        auto child = make_pawn_push(board, dest);
+
+                        // A double pawn push also passes through the square in between, which stays empty.
+                        auto touched = OneBB << dest | south(OneBB << dest) | south(south(OneBB << dest));
+                        count += count_child(child, touched);
+                }
+        };
+
+        visit_moves<Sliders>(board, visit_move, visit_pawn_pushes);
 
         return count;
 }
+
+
+// Collect the statistics of each legal move. Captures, en-passants, castles and promotions are all
+// found from the move and the enemy and en-passant masks. For checks, we make the move and use the
+// checking pieces found by `generate_movegen_info` for the opponent. A check is discovered if none
+// of these pieces just moved (so a double check by the moved piece and another is not discovered,
+// following the published tables).
+
+template <SliderBackend Sliders>
+void collect_move_statistics(Board const& board, MoveStatistics& stats)
+{
+        auto buffer = generate_moves<Sliders>(board);
+
+        auto enemy = board.occupied() &~ board.our;
+        auto en_passant = board.en_passant();
+
+        auto collect_checks = [&](Board const& child, BitBoard moved) {
+                MoveGenerationInfo info;
+                auto checks = generate_movegen_info<Sliders>(child, info);
+
+                if (!checks) return;
+
+                // The child is seen from the opponent's perspective, so rotate the squares we moved to.
+                stats.checks += 1;
+                stats.discovered_checks += (checks & rotate(moved)) == 0;
+                stats.double_checks += popcount(checks) > 1;
+                stats.checkmates += count_moves<Sliders>(child) == 0;
+        };
+
+        for (size_t i = 0; i < buffer.size; ++i) {
+                auto move = buffer.moves[i];
+
+                Square init = M_INIT(move);
+                Square dest = M_DEST(move);
+                auto moved = OneBB << dest;
+
+                if (move & M_CASTLING_MASK) {
+                        moved |= OneBB << ((dest + init) / 2); // the rook can give check too
+                        stats.castles += 1;
+                }
+
+                bool pawn = board.piece_on(init) == Pawn;
+
+                if (pawn && (moved & en_passant)) stats.en_passants += 1;
+                if (pawn && M_PIECE(move) != Pawn) stats.promotions += 1;
+                if (moved & (enemy | (pawn ? en_passant : 0))) stats.captures += 1;
+
+                collect_checks(make_move(board, move), moved);
+        }
+
+        stats.nodes += buffer.size;
+
+        while (buffer.pawn_pushes) {
+                auto dest = trailing_zeros_and_pop(buffer.pawn_pushes);
+
+                collect_checks(make_pawn_push(board, dest), OneBB << dest);
+                stats.nodes += 1;
+        }
+}
+
+
+// Explicit instantiations for the hot code in perft.cc, which calls the specialised versions directly.
+
+template MoveBuffer generate_moves<PextSliders>(Board const&);
+template MoveBuffer generate_moves<MagicSliders>(Board const&);
+template uint64_t count_moves<PextSliders>(Board const&);
+template uint64_t count_moves<MagicSliders>(Board const&);
+template uint64_t perft2<PextSliders>(Board const&);
+template uint64_t perft2<MagicSliders>(Board const&);
+template BitBoard generate_movegen_info<PextSliders>(Board const&, MoveGenerationInfo&);
+template BitBoard generate_movegen_info<MagicSliders>(Board const&, MoveGenerationInfo&);
+template uint64_t count_pawn_moves<PextSliders>(Board const&, MoveGenerationInfo const&);
+template uint64_t count_pawn_moves<MagicSliders>(Board const&, MoveGenerationInfo const&);
+
+
+// Everything else goes through these, which dispatch to the backend selected at startup.
+
+MoveBuffer generate_moves(Board const& board)
+{
+        return SelectedSliders == PextSliders ? generate_moves<PextSliders>(board) : generate_moves<MagicSliders>(board);
+}
+
+
+uint64_t count_moves(Board const& board)
+{
+        return SelectedSliders == PextSliders ? count_moves<PextSliders>(board) : count_moves<MagicSliders>(board);
+}
+
+
+uint64_t perft2(Board const& board)
+{
+        return SelectedSliders == PextSliders ? perft2<PextSliders>(board) : perft2<MagicSliders>(board);
+}
+
+
+void collect_move_statistics(Board const& board, MoveStatistics& stats)
+{
+        if (SelectedSliders == PextSliders) collect_move_statistics<PextSliders>(board, stats);
+        else                                collect_move_statistics<MagicSliders>(board, stats);
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include "bitboard.h"
 #include "board.h"
+#include "magic.h"
 
 /*
  *   Store a compressed move in 16 bits. The 'init' and 'dest' fields store the initial and
@@ -54,6 +55,322 @@ struct MoveBuffer {
 
 MoveBuffer generate_moves(Board const& board);
 uint64_t count_moves(Board const& board); // used to make leaf counting faster
+uint64_t perft2(Board const& board);       // dedicated kernel for depth 2
+
+// The same, specialised for one backend of sliding attacks (see magic.h). The versions above
+// dispatch to the backend selected at startup, so hot code should dispatch once and use these.
+
+template <SliderBackend Sliders> MoveBuffer generate_moves(Board const& board);
+template <SliderBackend Sliders> uint64_t count_moves(Board const& board);
+template <SliderBackend Sliders> uint64_t perft2(Board const& board);
+
+
+/*
+ *   Information that is passed around to move generation functions.
+ *   It stores (in order of definition):
+ *
+ *   - all squares attacked by enemy pieces to prevent illegal king walks
+ *   - all squares piece *must* move to, this is to block checks, or capture checking
+ *     pieces, etc...
+ *   - all squares that are pinned diagonally (see brackets below)
+ *   - all squares that are pinned orthogonally (not necessarily our or even occupied)
+ *   - square that our king is on
+ */
+
+struct MoveGenerationInfo {
+        BitBoard attacked;
+        BitBoard targets;
+        BitBoard pinned_diagonally;
+        BitBoard pinned_orthogonally;
+        Square   king;
+};
+
+
+// Single stages of move generation, only exposed for the microbenchmarks (see microbench.h).
+// The returned checks must be applied to the targets before counting pawn moves.
+template <SliderBackend Sliders> BitBoard generate_movegen_info(Board const& board, MoveGenerationInfo& info);
+template <SliderBackend Sliders> uint64_t count_pawn_moves(Board const& board, MoveGenerationInfo const& info);
+
+
+/*
+ *   Extended statistics of all legal moves in a position, as given in the tables of perft results
+ *   (https://www.chessprogramming.org/Perft_Results). These are much slower to collect than simply
+ *   counting moves, so they have their own separate code path, and plain perft doesn't pay for them.
+ */
+
+struct MoveStatistics {
+        uint64_t nodes;
+        uint64_t captures;
+        uint64_t en_passants;
+        uint64_t castles;
+        uint64_t promotions;
+        uint64_t checks;
+        uint64_t discovered_checks;
+        uint64_t double_checks;
+        uint64_t checkmates;
+
+        MoveStatistics& operator+=(MoveStatistics const& other) {
+                nodes             += other.nodes;
+                captures          += other.captures;
+                en_passants       += other.en_passants;
+                castles           += other.castles;
+                promotions        += other.promotions;
+                checks            += other.checks;
+                discovered_checks += other.discovered_checks;
+                double_checks     += other.double_checks;
+                checkmates        += other.checkmates;
+                return *this;
+        }
+};
+
+void collect_move_statistics(Board const& board, MoveStatistics& stats);
 
 Board make_move(Board board, Move move);
 Board make_pawn_push(Board board, Square dest);
+
+
+/*
+ *   Visitor move generation, for code that walks the children of a position once. Rather than
+ *   storing the moves in a MoveBuffer and reading them back, each move is passed straight to a
+ *   callable, which the compiler inlines into the generator. So these are templates defined here.
+ *
+ *   `visit_moves` calls `visit_move(Move)` for each move, and then `visit_pawn_pushes(BitBoard)`
+ *   with the destinations of all simple pawn pushes, for use with `make_pawn_push`. The order is
+ *   the same as in a MoveBuffer, which the position pool relies on to match its checkpoints.
+ *   `visit_children` calls `visit(Board const& child)` with the child of every legal move.
+ *
+ *   The stages are forced inline, as GCC otherwise outlines some of them differently for each
+ *   visitor, which made `generate_moves` half as fast again.
+ */
+
+// Generate pawn moves from a move mask, from a given direction. This allows us to
+// generate in more predictable loops.
+
+template <typename Visitor>
+[[gnu::always_inline]] inline void partially_generate_pawn_moves(Visitor& visit, BitBoard moves, Square direction, bool promotion)
+{
+        while (moves) {
+                auto dest = trailing_zeros_and_pop(moves);
+                auto init = dest - direction;
+
+                if (promotion) {
+                        visit(M(init, dest, Knight));
+                        visit(M(init, dest, Bishop));
+                        visit(M(init, dest, Rook));
+                        visit(M(init, dest, Queen));
+                }
+
+                else {
+                        visit(M(init, dest, Pawn));
+                }
+        }
+}
+
+
+template <SliderBackend Sliders, typename Visitor>
+[[gnu::always_inline]] inline BitBoard generate_pawn_moves(Visitor& visit, Board const& board, MoveGenerationInfo const& info)
+{
+        auto pawns   = board.extract_by_piece(Pawn) & board.our;
+        auto occ     = board.occupied();
+        auto enemy   = occ &~ board.our;
+        auto targets = info.targets;
+
+        auto en_passant = board.en_passant();
+        auto candidates = pawns & south(east(en_passant) | west(en_passant));
+
+        // Check for pinned en-passant. Note that this is a special type of pinned piece as two
+        // pieces dissappear in the checking direction. This introduces a slow branch into our pawn
+        // move generation, but it is a necessary evil for full legality, however rare. We optimise this
+        // branch by only checking if the king is actually on the 5th rank.
+
+        if (info.king / 8 == 4 && popcount(candidates) == 1) {
+                auto pinners = (board.extract_by_piece(Rook) | board.extract_by_piece(Queen)) &~ board.our;
+                auto clear = candidates | south(en_passant);
+
+                // If the pawn is "double" pinned, then en-passant is no longer possible
+                if (RookMagics[info.king].attacks<Sliders>(occ &~ clear) & pinners)
+                        en_passant = 0;
+        }
+
+        // Enable en-passant if the pawn being captured was giving check.
+        targets |= en_passant & north(info.targets);
+        enemy   |= en_passant;
+
+        auto pinned = info.pinned_diagonally | info.pinned_orthogonally;
+        auto unpinned_pawns = pawns &~ pinned;
+
+        // The only pinned pawns that can move foward are on same file as our king.
+        auto file = file_of(info.king);
+        auto forward = unpinned_pawns | (pawns & info.pinned_orthogonally & file);
+
+        auto single_move = north(forward) &~ occ;
+        auto double_move = north(single_move & Rank3BB) &~ occ;
+
+        auto east_capture = north(east(unpinned_pawns)) & enemy;
+        auto west_capture = north(west(unpinned_pawns)) & enemy;
+
+        // Again as with foward, we constrain pinned pawns capturing to staying diagonal to the king.
+        // This is a sufficient condition for legality.
+        auto pinned_east_capture = north(east(pawns & info.pinned_diagonally)) & enemy & info.pinned_diagonally;
+        auto pinned_west_capture = north(west(pawns & info.pinned_diagonally)) & enemy & info.pinned_diagonally;
+
+        single_move  = single_move & targets;
+        double_move  = double_move & targets;
+        east_capture = (east_capture | pinned_east_capture) & targets;
+        west_capture = (west_capture | pinned_west_capture) & targets;
+
+        // Handle promotions, note that double pawn moves cannot promote.
+        partially_generate_pawn_moves(visit, single_move  & Rank8BB, North,   true);
+        partially_generate_pawn_moves(visit, east_capture & Rank8BB, North+East, true);
+        partially_generate_pawn_moves(visit, west_capture & Rank8BB, North+West, true);
+
+        partially_generate_pawn_moves(visit, east_capture &~ Rank8BB, North+East, false);
+        partially_generate_pawn_moves(visit, west_capture &~ Rank8BB, North+West, false);
+
+        // Simple pawn pushes are returned rather than visited, see `visit_moves`.
+        return (single_move &~ Rank8BB) | double_move;
+}
+
+
+template <SliderBackend Sliders>
+inline BitBoard generic_attacks(PieceType piece, Square sq, BitBoard occ)
+{
+        switch (piece) {
+                case Knight: return KnightAttacks[sq];
+                case Bishop: return BishopMagics[sq].attacks<Sliders>(occ);
+                case Rook:   return RookMagics[sq].attacks<Sliders>(occ);
+                case Queen:  return BishopMagics[sq].attacks<Sliders>(occ)
+                                  | RookMagics[sq].attacks<Sliders>(occ);
+                default: __builtin_unreachable();
+        }
+}
+
+
+template <SliderBackend Sliders, typename Visitor>
+[[gnu::always_inline]] inline void generate_piece_moves(Visitor& visit, Board const& board, MoveGenerationInfo const& info, PieceType piece)
+{
+        auto pinned = info.pinned_diagonally | info.pinned_orthogonally;
+        auto pieces = board.extract_by_piece(piece) & board.our &~ pinned;
+
+        while (pieces) {
+                auto init = trailing_zeros_and_pop(pieces);
+                auto attacks = generic_attacks<Sliders>(piece, init, board.occupied()) & info.targets;
+
+                while (attacks) {
+                        auto dest = trailing_zeros_and_pop(attacks);
+                        visit(M(init, dest, piece));
+                }
+        }
+}
+
+
+template <SliderBackend Sliders, typename Visitor>
+[[gnu::always_inline]] inline void generate_pinned_piece_moves(Visitor& visit, Board const& board, MoveGenerationInfo const& info, PieceType moves_like)
+{
+        auto pinned = (moves_like == Bishop) ? info.pinned_diagonally : info.pinned_orthogonally;
+
+        auto pieces = board.extract_by_piece(moves_like);
+        auto queens = board.extract_by_piece(Queen);
+
+        pieces |= queens;
+        pieces &= board.our & pinned;
+
+        while (pieces) {
+                auto init = trailing_zeros_and_pop(pieces);
+
+                // As with pinned pawns, as long as the moves stay on a square that is pinned, then it is
+                // enough to satisfy legality. Note that for this to hold orthogonal and diagonal pins are
+                // separated.
+
+                auto attacks = generic_attacks<Sliders>(moves_like, init, board.occupied()) & info.targets & pinned;
+                auto actual_piece = (queens & (OneBB << init)) ? Queen : moves_like;
+
+                while (attacks) {
+                        auto dest = trailing_zeros_and_pop(attacks);
+                        visit(M(init, dest, actual_piece));
+                }
+        }
+}
+
+
+template <SliderBackend Sliders, typename Visitor>
+[[gnu::always_inline]] inline void generate_king_moves(Visitor& visit, Board const& board, MoveGenerationInfo const& info)
+{
+        auto attacks = KingAttacks[info.king] & info.targets;
+        attacks &= ~info.attacked;
+
+        while (attacks) {
+                auto dest = trailing_zeros_and_pop(attacks);
+                visit(M(info.king, dest, King));
+        }
+
+        // If our king is not on E1, it must have moved, so castling of any kind is no longer possible.
+        // So we safely can optimise with an early return.
+        if (info.king != E1) return;
+
+        // Get a mask of rooks we can castle with, and that there are no occupied squares between our
+        // king and that rook.
+        auto castling = board.extract_by_piece(Castle)
+                      & RookMagics[info.king].attacks<Sliders>(board.occupied());
+
+        // We also then check that none of the squares between the king and the rook, including the
+        // king's square itself, are attacked. Note that castling our of check is illegal.
+        constexpr auto QueensideInbetween = (OneBB << C1 | OneBB << D1 | OneBB << E1);
+        constexpr auto KingsideInbetween = (OneBB << E1 | OneBB << F1 | OneBB << G1);
+
+        if (castling & (OneBB << A1) && !(QueensideInbetween & info.attacked)) visit(M_CASTLING(C1));
+        if (castling & (OneBB << H1) && !(KingsideInbetween & info.attacked))  visit(M_CASTLING(G1));
+}
+
+
+// Generate all legal moves for a given position. It is assumed that board itself is a legal
+// position, otherwise UB may occur (assumptions that we have a king may no longer be true).
+
+template <SliderBackend Sliders, typename MoveVisitor, typename PawnPushVisitor>
+[[gnu::always_inline]] inline void visit_moves(Board const& board, MoveVisitor&& visit_move, PawnPushVisitor&& visit_pawn_pushes)
+{
+        MoveGenerationInfo info;
+
+        auto checks = generate_movegen_info<Sliders>(board, info);
+        generate_king_moves<Sliders>(visit_move, board, info);
+
+        // If we are in check from more than one piece, then we can only move king otherwise
+        // we must block the check, or capture the checking piece
+        if (popcount(checks) > 1) return;
+        if (checks) info.targets &= LineBetween[info.king][trailing_zeros(checks)];
+
+        auto pawn_pushes = generate_pawn_moves<Sliders>(visit_move, board, info);
+
+        // Generate regular moves for non-pinned pieces
+        generate_piece_moves<Sliders>(visit_move, board, info, Knight);
+        generate_piece_moves<Sliders>(visit_move, board, info, Bishop);
+        generate_piece_moves<Sliders>(visit_move, board, info, Rook);
+        generate_piece_moves<Sliders>(visit_move, board, info, Queen);
+
+        // Generate moves of pinned pieces, note: pinned knights can never move
+        if ((info.pinned_orthogonally | info.pinned_diagonally) & board.our) {
+                generate_pinned_piece_moves<Sliders>(visit_move, board, info, Bishop);
+                generate_pinned_piece_moves<Sliders>(visit_move, board, info, Rook);
+        }
+
+        visit_pawn_pushes(pawn_pushes);
+}
+
+
+template <SliderBackend Sliders, typename Visitor>
+[[gnu::always_inline]] inline void visit_children(Board const& board, Visitor&& visit)
+{
+        visit_moves<Sliders>(board, [&](Move move) { visit(make_move(board, move)); },
+                                    [&](BitBoard pawn_pushes) {
+                                            while (pawn_pushes) visit(make_pawn_push(board, trailing_zeros_and_pop(pawn_pushes)));
+                                    });
+}
+
+
+// Dispatch to the backend selected at startup, for code that isn't hot enough to dispatch itself.
+template <typename Visitor>
+void visit_children(Board const& board, Visitor&& visit)
+{
+        if (SelectedSliders == PextSliders) visit_children<PextSliders>(board, visit);
+        else                                visit_children<MagicSliders>(board, visit);
+}
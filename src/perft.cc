@@ -1,4 +1,5 @@
 #include <atomic>
+#include <type_traits>
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -7,89 +8,131 @@
 #include <time.h>
 #include <threads.h>
 #include <unistd.h>
+#include <x86intrin.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
+#include "affinity.h"
 #include "board.h"
+#include "hash.h"
 #include "magic.h"
 #include "movegen.h"
-#include "fen.cc" // Embed FEN parsing code
+#include "perft.h"
+
+#ifdef PERFT_BATCHED_LEAVES
+#include "batch.h"
+#endif
 
 #define atomic(T) std::atomic<T>
 
 
-typedef unsigned Depth;
-typedef uint64_t Nodes;
-typedef double Seconds;
+/*
+ *   Multi-threaded perft uses a work-stealing scheduler. The work is first split into a shallow pool
+ *   of positions which are handed out to workers one at a time. On positions with very uneven
+ *   subtrees this alone leaves most workers idle at the end, while the last few large subtrees are
+ *   counted. So whenever a worker is idle, busy workers split the subtree they are counting,
+ *   by pushing its remaining children to their own task queue, from which idle workers steal.
+ *
+ *   As perft is just a sum, tasks never have to wait for each other. The result of every task is
+ *   simply added to the total, and we are done when there are no pending tasks.
+ *
+ *   The scheduler runs a list of jobs (see perft.h) at once, and every task remembers the job it
+ *   counts towards. Each job keeps track of its own outstanding tasks, so that it can be reported
+ *   as soon as it is finished, e.g. every root move for perft divide. Likewise every task remembers
+ *   the entry of the position pool it descends from, so that finished entries can be checkpointed.
+ */
+
+struct PerftTask {
+        Board    board;
+        Depth    depth;
+        uint32_t job;
+        uint32_t entry;
+};
 
+// Only split nodes of at least this depth, so that stolen tasks are worth the overhead.
+constexpr Depth SplitMinimumDepth = 4;
+static_assert(SplitMinimumDepth >= TTMinimumDepth, "split_perft probes the table at every node");
 
-struct PerftThreadInfo {
-        Board*          board_buffer;
-        size_t          buffer_size;
-        atomic(size_t)  buffer_done;
+// A worker only splits when its queue is empty, so at most one node's children are queued.
+constexpr size_t TaskQueueCapacity = 256;
+static_assert(TaskQueueCapacity >= MaximumLegalMoves, "task queue must fit all children of a node");
 
-        Depth           depth;
-        atomic(Nodes)   result;
+
+struct alignas(64) PerftWorker {
+        struct PerftScheduler* scheduler;
+        size_t index;
+
+        // Double-ended task queue, the owner pops from the back and thieves steal from the front.
+        // The lock is only ever contended when splitting, which is rare.
+        mtx_t           lock;
+        size_t          head;
+        atomic(size_t)  size;
+        PerftTask       tasks[TaskQueueCapacity];
+
+        // Progress of this worker, only written by itself when it finishes a task, and read by the
+        // progress reporter. Kept on their own cache line, away from the queue touched by thieves.
+        alignas(64)
+        atomic(Nodes)   nodes_done;
+        atomic(size_t)  entries_done;       // pool entries this worker finished the last task of
+        atomic(Nodes)   entry_nodes_done;   // and their total node counts
 };
 
 
-//  Unit-testing structure containing an FEN, and the (maximum) depth, as well as a list of expected
-//  perft results at a given depth
+struct alignas(64) PerftJobState {
+        atomic(Nodes)   nodes;
+        atomic(Seconds) seconds;     // total time spent by all threads on this job
+        atomic(size_t)  outstanding; // tasks of this job that are not yet counted
+};
+
 
-struct PerftTest {
-        char const* name;
-        char const* FEN;
-        Depth       depth;
-        Nodes       expected[7];
+struct PerftEntryState {
+        atomic(Nodes)   nodes;
+        atomic(size_t)  outstanding;
 };
 
 
+// Tasks either count nodes, or collect extended statistics when the caller asks for them. Both are
+// summed the same way, so the scheduler is generic over the result of a task.
 
-// Unit-test results we obtained from (https://www.chessprogramming.org/Perft_Results)
-const PerftTest PerftTests[] =
-{
-        { .name = "startpos",
-          .FEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
-          .depth = 6,
-          .expected = { 20, 400, 8902, 197281, 4865609, 119060324 },
-        },
-
-        { .name = "kiwipete",
-          .FEN = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -",
-          .depth = 5,
-          .expected = { 48, 2039, 97862, 4085603, 193690690 },
-        },
-
-        { .name = "tricky en-passant",
-          .FEN = "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -",
-          .depth = 7,
-          .expected = { 14, 191, 2812, 43238, 674624, 11030083, 178633661 },
-        },
-
-        { .name = "tricky castling",
-          .FEN = "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq -",
-          .depth = 6,
-          .expected = { 6, 264, 9467, 422333, 15833292, 706045033 },
-        },
-
-        { .name = "tricky castling rotated",
-          .FEN = "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ -",
-          .depth = 6,
-          .expected = { 6, 264, 9467, 422333, 15833292, 706045033 },
-        },
-
-        { .name = "talkchess",
-          .FEN = "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ -",
-          .depth = 5,
-          .expected = { 44, 1486, 62379, 2103487, 89941194 },
-        },
-
-        { .name = "normal middlegame",
-          .FEN = "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - -",
-          .depth = 5,
-          .expected = { 46, 2079, 89890, 3894594, 164075551 },
-        },
+template <typename Result> struct PerftResult;
+
+template <> struct PerftResult<Nodes> {
+        static Nodes leaf(Board const& board, Depth depth) { return depth ? perft(board, depth) : 1; }
+        static Nodes nodes(Nodes result) { return result; }
 };
 
-constexpr size_t NumberOfPerftTests = sizeof(PerftTests) / sizeof(PerftTests[0]);
+template <> struct PerftResult<MoveStatistics> {
+        static MoveStatistics leaf(Board const& board, Depth depth) {
+                MoveStatistics stats = {};
+                perft_statistics(board, depth, stats);
+                return stats;
+        }
+
+        static Nodes nodes(MoveStatistics const& result) { return result.nodes; }
+};
+
+
+struct PerftScheduler {
+        PerftTask*      task_buffer;
+        size_t          buffer_size;
+        atomic(size_t)  buffer_done;
+
+        PerftJobState*  jobs;
+        PerftEntryState* entries; // of the position pool, including those skipped on resuming
+        PerftCallback   callback;
+        void*           context;
+
+        // Only when collecting extended statistics, the statistics of each job (guarded by the lock).
+        MoveStatistics* stats;
+        mtx_t           stats_lock;
+
+        PerftWorker*    workers;
+        size_t          number_of_workers;
+
+        atomic(size_t)  pending; // pool entries and split tasks that are not yet counted
+        atomic(size_t)  idle_workers;
+        atomic(Nodes)   result;
+};
 
 
 double get_time_from_os() {
@@ -100,203 +143,797 @@ double get_time_from_os() {
 }
 
 
+#ifdef PERFT_BATCHED_LEAVES
+
+// Count the leaves of a depth 2 node, by counting the moves of all its children at once.
+template <SliderBackend Sliders>
+Nodes perft2_batched(Board const& pos)
+{
+        BoardBatch batch;
+        batch.size = 0;
+
+        visit_children<Sliders>(pos, [&](Board const& child) { batch.push(child); });
+
+        return count_moves(batch);
+}
+
+#endif
+
+
 // Recursively compute perft result, requires depth >= 1!
+template <SliderBackend Sliders>
 Nodes perft(Board const& pos, Depth depth)
 {
-        if (depth == 1) return count_moves(pos);
-        auto buffer = generate_moves(pos);
+        if (depth == 1) return count_moves<Sliders>(pos);
+
+#ifdef PERFT_BATCHED_LEAVES
+        if (depth == 2) return perft2_batched<Sliders>(pos);
+#else
+        if (depth == 2) return perft2<Sliders>(pos);
+#endif
+
+        // Interior nodes are looked up in the transposition table, if enabled.
+        Key key = 0;
+        Nodes cached;
+        bool use_tt = TT.enabled() && depth >= TTMinimumDepth;
+
+        if (use_tt) {
+                key = board_key(pos);
+                if (tt_probe(key, depth, cached)) return cached;
+        }
 
         Nodes total = 0;
 
-        for (size_t i = 0; i < buffer.size; i += 1) {
-                auto child = make_move(pos, buffer.moves[i]);
-                total += perft(child, depth - 1);
+        visit_children<Sliders>(pos, [&](Board const& child) {
+                total += perft<Sliders>(child, depth - 1);
+        });
+
+        if (use_tt) tt_store(key, depth, total);
+        return total;
+}
+
+
+// Dispatch to the backend of sliding attacks once, at the root.
+Nodes perft(Board const& pos, Depth depth)
+{
+        return SelectedSliders == PextSliders ? perft<PextSliders>(pos, depth) : perft<MagicSliders>(pos, depth);
+}
+
+
+// Same as perft, but collecting the extended statistics of the moves at the last ply.
+void perft_statistics(Board const& pos, Depth depth, MoveStatistics& stats)
+{
+        if (depth == 0) {
+                stats.nodes += 1;
+                return;
+        }
+
+        if (depth == 1) return collect_move_statistics(pos, stats);
+
+        visit_children(pos, [&](Board const& child) {
+                perft_statistics(child, depth - 1, stats);
+        });
+}
+
+
+// Multi-threaded perft implementation. First a shallow perft is done to create a position pool (see
+// `build_position_pool`), which is then consumed by $(number of cpu cores) threads, see the scheduler
+// above.
+
+
+void push_task(PerftWorker& worker, PerftTask const& task)
+{
+        worker.scheduler->pending += 1;
+        worker.scheduler->jobs[task.job].outstanding += 1;
+        worker.scheduler->entries[task.entry].outstanding += 1;
+
+        mtx_lock(&worker.lock);
+        worker.tasks[(worker.head + worker.size) % TaskQueueCapacity] = task;
+        worker.size += 1;
+        mtx_unlock(&worker.lock);
+}
+
+
+bool pop_task(PerftWorker& worker, PerftTask& task, bool steal)
+{
+        if (worker.size.load(std::memory_order_relaxed) == 0) return false;
+
+        mtx_lock(&worker.lock);
+        bool found = worker.size > 0;
+
+        if (found && steal) {
+                task = worker.tasks[worker.head];
+                worker.head = (worker.head + 1) % TaskQueueCapacity;
+                worker.size -= 1;
         }
 
-        while (buffer.pawn_pushes) {
-                auto child = make_pawn_push(pos, trailing_zeros_and_pop(buffer.pawn_pushes));
-                total += perft(child, depth - 1);
+        else if (found) {
+                worker.size -= 1;
+                task = worker.tasks[(worker.head + worker.size) % TaskQueueCapacity];
+        }
+
+        mtx_unlock(&worker.lock);
+        return found;
+}
+
+
+// Find the next task for a worker: first from its own queue, then from the position pool, and
+// finally by stealing from another worker.
+
+bool find_task(PerftWorker& worker, PerftTask& task)
+{
+        auto& scheduler = *worker.scheduler;
+
+        if (pop_task(worker, task, false)) return true;
+
+        if (scheduler.buffer_done.load(std::memory_order_relaxed) < scheduler.buffer_size) {
+                size_t index = atomic_fetch_add(&scheduler.buffer_done, 1);
+
+                if (index < scheduler.buffer_size) {
+                        task = scheduler.task_buffer[index];
+                        return true;
+                }
+        }
+
+        for (size_t i = 1; i < scheduler.number_of_workers; ++i) {
+                auto& victim = scheduler.workers[(worker.index + i) % scheduler.number_of_workers];
+                if (pop_task(victim, task, true)) return true;
+        }
+
+        return false;
+}
+
+
+// Add a count to a counter that only this thread writes, which needs no atomic read-modify-write.
+template <typename T>
+void add_relaxed(atomic(T)& counter, T value)
+{
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+
+// Add the result of a task to its job, and report the job if this was its last task.
+template <typename Result>
+void finish_task(PerftWorker& worker, PerftTask const& task, Result const& result, Seconds seconds)
+{
+        auto& scheduler = *worker.scheduler;
+        auto& job = scheduler.jobs[task.job];
+        auto& entry = scheduler.entries[task.entry];
+        auto nodes = PerftResult<Result>::nodes(result);
+
+        if constexpr (!std::is_same_v<Result, Nodes>) {
+                mtx_lock(&scheduler.stats_lock);
+                scheduler.stats[task.job] += result;
+                mtx_unlock(&scheduler.stats_lock);
+        }
+
+        atomic_fetch_add(&job.nodes, nodes);
+        atomic_fetch_add(&job.seconds, seconds);
+        atomic_fetch_add(&scheduler.result, nodes);
+
+        atomic_fetch_add(&entry.nodes, nodes);
+        add_relaxed(worker.nodes_done, nodes);
+
+        if (atomic_fetch_sub(&entry.outstanding, 1) == 1) {
+                add_relaxed(worker.entries_done, (size_t) 1);
+                add_relaxed(worker.entry_nodes_done, entry.nodes.load());
+        }
+
+        if (atomic_fetch_sub(&job.outstanding, 1) == 1 && scheduler.callback)
+                scheduler.callback(scheduler.context, task.job, job.nodes, job.seconds);
+
+        atomic_fetch_sub(&scheduler.pending, 1);
+}
+
+
+// Same as perft, except that the remaining children are pushed as tasks if another worker is idle.
+template <typename Result>
+Result split_perft(PerftWorker& worker, PerftTask const& task)
+{
+        if (task.depth < SplitMinimumDepth) return PerftResult<Result>::leaf(task.board, task.depth);
+
+        // Only node counts are stored in the transposition table.
+        constexpr bool use_tt = std::is_same_v<Result, Nodes>;
+
+        Key key = 0;
+        Nodes cached;
+
+        if constexpr (use_tt) {
+                if (TT.enabled()) {
+                        key = board_key(task.board);
+                        if (tt_probe(key, task.depth, cached)) return cached;
+                }
+        }
+
+        auto& idle_workers = worker.scheduler->idle_workers;
+
+        Result total = {};
+        bool split = false;
+
+        // Only split if our own queue is empty, otherwise idle workers can still steal from it.
+        auto should_split = [&]() {
+                return split || (idle_workers.load(std::memory_order_relaxed) > 0
+                             &&  worker.size.load(std::memory_order_relaxed) == 0);
+        };
+
+        visit_children(task.board, [&](Board const& board) {
+                PerftTask child = { board, task.depth - 1, task.job, task.entry };
+
+                if ((split = should_split())) push_task(worker, child);
+                else total += split_perft<Result>(worker, child);
+        });
+
+        // The total is only partial if we split, so it can't be stored.
+        if constexpr (use_tt) {
+                if (TT.enabled() && !split) tt_store(key, task.depth, total);
         }
 
         return total;
 }
 
 
-// Multi-threaded perft implementation. First a shallow depth 2 perft is done to create a position
-// pool, which is then consumed by $(number of cpu cores) threads.
+void run_perft_worker(PerftWorker& worker)
+{
+        auto& scheduler = *worker.scheduler;
+        bool idle = false;
+
+        // Note that a task pushes its children before it is finished, so pending tasks can only
+        // reach zero when all work is done.
+        while (scheduler.pending > 0) {
+                PerftTask task;
+
+                if (!find_task(worker, task)) {
+                        if (!idle) scheduler.idle_workers += 1;
+                        idle = true;
 
+                        thrd_yield();
+                        continue;
+                }
 
-int start_perft_thread(void* opaque_thread_info)
+                if (idle) scheduler.idle_workers -= 1;
+                idle = false;
+
+                auto t1 = get_time_from_os();
+
+                if (scheduler.stats) {
+                        auto result = split_perft<MoveStatistics>(worker, task);
+                        finish_task(worker, task, result, get_time_from_os() - t1);
+                }
+
+                else {
+                        auto result = split_perft<Nodes>(worker, task);
+                        finish_task(worker, task, result, get_time_from_os() - t1);
+                }
+        }
+
+        flush_tt_stats();
+}
+
+
+/*
+ *   The workers run on a pool of threads, which is started by the first run and kept for the whole
+ *   process, so that runs don't pay for creating threads. Thread `i` always runs worker `i`, and is
+ *   pinned once when it starts. Between runs the threads spin for a moment, in case the next run
+ *   follows right away, and then sleep on a futex. Threads that don't have a cpu of their own, next
+ *   to the thread that starts the runs, go to sleep at once, as spinning would only slow the others.
+ *
+ *   A run is started by publishing its scheduler, and bumping the start word, which holds both a
+ *   generation count and the number of threads taking part in the run. As these are read at once, a
+ *   thread that slept through earlier runs can't mistake which run it is part of. The caller then
+ *   sleeps on the count of threads still running, until the last of them wakes it.
+ */
+
+constexpr size_t MaximumThreads = 256;
+constexpr unsigned PoolThreadsBits = 9; // of the start word, enough for `MaximumThreads`
+constexpr uint64_t PoolSpinTicks = 50'000; // some tens of microseconds
+
+struct PerftThreadPool {
+        thrd_t           threads[MaximumThreads];
+        uint32_t         created_at[MaximumThreads]; // start word when each thread was created
+        size_t           number_of_threads;
+
+        PerftScheduler*  scheduler;
+        atomic(uint32_t) start;    // generation << PoolThreadsBits | threads taking part
+        atomic(uint32_t) running;  // threads taking part that haven't finished yet
+        atomic(uint32_t) sleeping; // threads waiting for the next run
+};
+
+PerftThreadPool ThreadPool;
+
+
+long futex(atomic(uint32_t)& word, int operation, uint32_t value)
 {
-        assert(opaque_thread_info != nullptr);
-        auto& thread_info = *(PerftThreadInfo*) opaque_thread_info;
+        static_assert(sizeof(word) == sizeof(uint32_t));
+        return syscall(SYS_futex, (uint32_t*) &word, operation, value, nullptr, nullptr, 0);
+}
+
+
+int start_pool_thread(void* opaque_index)
+{
+        auto index = (size_t) opaque_index;
+        auto& pool = ThreadPool;
+
+        place_thread(index);
+        auto seen = pool.created_at[index];
+
+        bool spin = index + 1 < (size_t) sysconf(_SC_NPROCESSORS_ONLN);
 
         while (true) {
-                size_t index = atomic_fetch_add(&thread_info.buffer_done, 1);
-                if (index >= thread_info.buffer_size) break;
+                for (auto t = __rdtsc(); spin && pool.start == seen && __rdtsc() - t < PoolSpinTicks;) _mm_pause();
 
-                auto& position = thread_info.board_buffer[index];
+                while (pool.start == seen) {
+                        pool.sleeping += 1;
+                        futex(pool.start, FUTEX_WAIT_PRIVATE, seen);
+                        pool.sleeping -= 1;
+                }
 
-                Nodes nodes = perft(position, thread_info.depth);
-                atomic_fetch_add(&thread_info.result, nodes);
+                seen = pool.start;
+                if (index >= (seen & ((1u << PoolThreadsBits) - 1))) continue;
+
+                run_perft_worker(pool.scheduler->workers[index]);
+                if (--pool.running == 0) futex(pool.running, FUTEX_WAKE_PRIVATE, 1);
         }
 
         return 0;
 }
 
 
-void populate_position_pool(Board const& board, Depth depth, Board position_pool[], size_t& position_pool_size)
+// Start a run on the first `number_of_threads` threads of the pool, which is grown as needed.
+// Runs can't overlap, they are only started from one thread at a time.
+void start_pool_run(PerftScheduler& scheduler, size_t number_of_threads)
+{
+        auto& pool = ThreadPool;
+        uint32_t start = pool.start;
+
+        assert(pool.running == 0 && "runs can't overlap!");
+
+        while (pool.number_of_threads < number_of_threads) {
+                auto index = pool.number_of_threads++;
+
+                pool.created_at[index] = start;
+                thrd_create(&pool.threads[index], start_pool_thread, (void*) index);
+        }
+
+        pool.scheduler = &scheduler;
+        pool.running = number_of_threads;
+
+        uint32_t generation = (start >> PoolThreadsBits) + 1;
+        pool.start = generation << PoolThreadsBits | number_of_threads;
+
+        // A thread that goes to sleep after this check sees the new start word in the futex call.
+        if (pool.sleeping > 0) futex(pool.start, FUTEX_WAKE_PRIVATE, MaximumThreads);
+}
+
+
+void wait_for_pool_run()
+{
+        auto& pool = ThreadPool;
+
+        for (uint32_t running; (running = pool.running) > 0;) {
+                futex(pool.running, FUTEX_WAIT_PRIVATE, running);
+        }
+}
+
+
+// Growable arena of tasks for the position pool, so that it can be split as finely as needed.
+
+struct PositionPool {
+        PerftTask*  tasks;
+        size_t      size;
+        size_t      capacity;
+
+        void push(PerftTask const& task) {
+                if (size == capacity) {
+                        capacity = capacity ? 2 * capacity : 256;
+                        tasks = (PerftTask*) realloc(tasks, capacity * sizeof(PerftTask));
+                        assert(tasks != nullptr && "position pool allocation failed!");
+                }
+
+                tasks[size++] = task;
+        }
+};
+
+
+// Push all descendants of a task, that are the given number of plies deeper, to the pool.
+void populate_position_pool(PerftTask const& task, Depth depth, PositionPool& position_pool)
 {
         if (depth == 0) {
-                position_pool[position_pool_size++] = board;
+                position_pool.push(task);
+                return;
+        }
+
+        visit_children(task.board, [&](Board const& board) {
+                PerftTask child = { board, task.depth - 1, task.job, task.entry };
+                populate_position_pool(child, depth - 1, position_pool);
+        });
+}
+
+
+// Choose the depth of the position pool at run time, by expanding it until there are enough tasks
+// per thread for a good balance, but not so many that setting up the tasks would start to dominate.
+
+void build_position_pool(PerftJob const jobs[], size_t number_of_jobs, size_t number_of_threads, PositionPool& position_pool)
+{
+        constexpr size_t TasksPerThread = 32;
+
+        for (size_t i = 0; i < number_of_jobs; ++i) {
+                position_pool.push({ jobs[i].board, jobs[i].depth, (uint32_t) i, 0 });
+        }
+
+        expand_to_target(position_pool.size, number_of_threads * TasksPerThread, [&](size_t& size) {
+                // Always leave at least one ply to each task.
+                PositionPool next = {};
+                bool expanded = false;
+
+                for (size_t i = 0; i < position_pool.size; ++i) {
+                        auto& task = position_pool.tasks[i];
+
+                        if (task.depth > 1) populate_position_pool(task, 1, next), expanded = true;
+                        else next.push(task);
+                }
+
+                if (!expanded) {
+                        free(next.tasks);
+                        return false;
+                }
+
+                free(position_pool.tasks);
+                position_pool = next;
+                size = position_pool.size;
+
+                return true;
+        });
+}
+
+
+// Write the node counts of all finished pool entries. The file is replaced atomically, so that a
+// run killed while writing still leaves the previous checkpoint.
+
+void write_checkpoint(PerftScheduler const& scheduler, PerftCheckpoint const& checkpoint, Key fingerprint, size_t pool_size)
+{
+        char temporary_path[4096];
+        snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", checkpoint.path);
+
+        FILE* file = fopen(temporary_path, "w");
+
+        if (file == nullptr) {
+                fprintf(stderr, "warning: could not write checkpoint %s.\n", temporary_path);
                 return;
         }
 
-        auto buffer = generate_moves(board);
+        fprintf(file, "perft-checkpoint %zu %zu %016lx\n", checkpoint.pool_threads, pool_size, fingerprint);
 
-        for (size_t i = 0; i < buffer.size; ++i) {
-                auto child = make_move(board, buffer.moves[i]);
-                populate_position_pool(child, depth - 1, position_pool, position_pool_size);
+        for (size_t i = 0; i < pool_size; ++i) {
+                auto& entry = scheduler.entries[i];
+                if (entry.outstanding == 0) fprintf(file, "%zu %lu\n", i, entry.nodes.load());
         }
 
-        while (buffer.pawn_pushes) {
-                auto child = make_pawn_push(board, trailing_zeros_and_pop(buffer.pawn_pushes));
-                populate_position_pool(child, depth - 1, position_pool, position_pool_size);
+        if (fclose(file) != 0 || rename(temporary_path, checkpoint.path) != 0) {
+                fprintf(stderr, "warning: could not write checkpoint %s.\n", checkpoint.path);
         }
 }
 
 
-Nodes threaded_perft(Board const& board, Depth depth, size_t number_of_threads)
+// Identify the jobs of a checkpoint, so that it is never resumed for another position or depth.
+Key checkpoint_fingerprint(PerftJob const jobs[], size_t number_of_jobs)
 {
-        constexpr size_t MAX_THREAD_COUNT = 256;
-        constexpr Depth POPULATION_DEPTH = 2;
+        Key fingerprint = number_of_jobs;
 
-        assert(depth > POPULATION_DEPTH);
-        assert(number_of_threads > 0);
-        assert(number_of_threads <= MAX_THREAD_COUNT);
+        for (size_t i = 0; i < number_of_jobs; ++i) {
+                fingerprint = fold_multiply(fingerprint ^ hash_board(jobs[i].board), 0x9e37'79b9'7f4a'7c15 ^ jobs[i].depth);
+        }
 
-        Board position_pool[1 << 14];
-        size_t position_pool_size = 0;
+        return fingerprint;
+}
 
-        populate_position_pool(board, POPULATION_DEPTH, position_pool, position_pool_size);
-        thrd_t threads[MAX_THREAD_COUNT];
 
-        PerftThreadInfo info = {
-                .board_buffer = position_pool,
-                .buffer_size = position_pool_size,
-                .depth = depth - POPULATION_DEPTH,
-        };
+bool load_checkpoint(PerftCheckpoint& checkpoint, PerftJob const jobs[], size_t number_of_jobs)
+{
+        checkpoint.pool_size = 0;
+        checkpoint.failed = false;
+        checkpoint.number_of_finished = 0;
+        checkpoint.finished_entries = nullptr;
+        checkpoint.finished_nodes = nullptr;
+
+        // Nothing to resume yet.
+        FILE* file = fopen(checkpoint.path, "r");
+        if (file == nullptr) return true;
+
+        size_t pool_threads, pool_size;
+        Key fingerprint;
+
+        if (fscanf(file, "perft-checkpoint %zu %zu %lx", &pool_threads, &pool_size, &fingerprint) != 3) {
+                fprintf(stderr, "error: %s is not a perft checkpoint.\n", checkpoint.path);
+                fclose(file);
+                return false;
+        }
 
-        atomic_init(&info.buffer_done, 0);
-        atomic_init(&info.result, 0);
+        if (fingerprint != checkpoint_fingerprint(jobs, number_of_jobs)) {
+                fprintf(stderr, "error: checkpoint %s is for a different position or depth.\n", checkpoint.path);
+                fclose(file);
+                return false;
+        }
 
-        for (size_t i = 0; i < number_of_threads; ++i) {
-                thrd_create(&threads[i], start_perft_thread, &info);
+        checkpoint.pool_threads = pool_threads;
+        checkpoint.pool_size = pool_size;
+
+        // The arrays grow with the entries actually read, as a damaged header could claim any pool
+        // size. The pool size itself is checked against the rebuilt pool by `threaded_perft`.
+        size_t capacity = 0;
+        size_t index;
+        unsigned long nodes;
+        int fields;
+
+        while ((fields = fscanf(file, "%zu %lu", &index, &nodes)) == 2) {
+                if (index >= pool_size || checkpoint.number_of_finished == pool_size) break;
+
+                if (checkpoint.number_of_finished == capacity) {
+                        capacity = capacity ? 2 * capacity : 1024;
+
+                        checkpoint.finished_entries = (size_t*) realloc(checkpoint.finished_entries, capacity * sizeof(size_t));
+                        checkpoint.finished_nodes = (Nodes*) realloc(checkpoint.finished_nodes, capacity * sizeof(Nodes));
+                        assert(checkpoint.finished_entries && checkpoint.finished_nodes && "checkpoint allocation failed!");
+                }
+
+                checkpoint.finished_entries[checkpoint.number_of_finished] = index;
+                checkpoint.finished_nodes[checkpoint.number_of_finished] = nodes;
+                checkpoint.number_of_finished += 1;
         }
 
-        for (size_t i = 0; i < number_of_threads; ++i) {
-                thrd_join(threads[i], nullptr);
+        bool ok = fields == EOF;
+        fclose(file);
+
+        if (!ok) {
+                fprintf(stderr, "error: checkpoint %s is corrupted.\n", checkpoint.path);
+                free_checkpoint(checkpoint);
         }
 
-        return info.result;
+        return ok;
 }
 
 
-void bench()
+void free_checkpoint(PerftCheckpoint& checkpoint)
 {
-        auto cpu_core_count = sysconf(_SC_NPROCESSORS_ONLN);
+        free(checkpoint.finished_entries);
+        free(checkpoint.finished_nodes);
+
+        checkpoint.number_of_finished = 0;
+        checkpoint.finished_entries = nullptr;
+        checkpoint.finished_nodes = nullptr;
+}
 
-        Seconds total_time = 0.0;
-        Nodes total_nodes = 0;
 
-        printf("name                      depth       nodes    \n");
-        printf("===============================================\n");
+// Live progress of a run, reported from the per-thread counters of the workers. The size of the
+// run is estimated from the pool entries finished so far, assuming the rest are of the same size on
+// average, which is rough early on, but quickly settles as more entries finish.
 
-        for (size_t index = 0; index < NumberOfPerftTests; index += 1)
-        {
-                auto test = PerftTests[index];
+Seconds ProgressInterval = 0.0;
 
-                bool white_to_move, ok;
-                auto board = parse_fen(test.FEN, &white_to_move, &ok);
-                assert(ok && "FEN parsing failed!");
+struct PerftProgress {
+        Seconds start;
+        size_t  pool_size;
+        size_t  resumed_entries;
+        Nodes   resumed_nodes;
+
+        Seconds last_time;
+        Nodes   last_nodes;
+        bool    reported;
+};
 
-                auto t1 = get_time_from_os();
-                auto nodes = threaded_perft(board, test.depth, cpu_core_count);
-                auto t2 = get_time_from_os();
 
-                auto seconds = t2 - t1;
-                printf("%-25s %-5u       %9zu\t\t(%6.3f Gnps)\n", test.name, test.depth, nodes, nodes / seconds / 1.0e9);
+void report_progress(PerftScheduler const& scheduler, PerftProgress& progress, Seconds now)
+{
+        Nodes nodes = 0, entry_nodes = progress.resumed_nodes;
+        size_t entries = progress.resumed_entries;
 
-                total_nodes += nodes;
-                total_time += seconds;
+        for (size_t i = 0; i < scheduler.number_of_workers; ++i) {
+                auto& worker = scheduler.workers[i];
 
-                auto expected = test.expected[test.depth - 1];
-                assert(nodes == expected && "TEST FAILED!");
+                nodes       += worker.nodes_done.load(std::memory_order_relaxed);
+                entries     += worker.entries_done.load(std::memory_order_relaxed);
+                entry_nodes += worker.entry_nodes_done.load(std::memory_order_relaxed);
         }
 
-        printf("\nAverage nodes per second: %6.3f Gnps\n", total_nodes / total_time / 1.0e9);
+        auto since_last = now - (progress.last_time ? progress.last_time : progress.start);
+        auto current_rate = (nodes - progress.last_nodes) / since_last;
+        auto average_rate = nodes / (now - progress.start);
+
+        progress.last_time = now;
+        progress.last_nodes = nodes;
+
+        // Use the average rate for the ETA, as tasks finish in bursts.
+        char eta[32] = "?";
+
+        if (entries > 0 && average_rate > 0) {
+                auto estimated_total = (double) entry_nodes / entries * progress.pool_size;
+                auto remaining = estimated_total - (nodes + progress.resumed_nodes);
+                auto seconds = (unsigned long) (remaining > 0 ? remaining / average_rate : 0);
+
+                snprintf(eta, sizeof(eta), "%lu:%02lu:%02lu", seconds / 3600, seconds / 60 % 60, seconds % 60);
+        }
+
+        // Overwrite the previous report on a terminal, otherwise keep one report per line.
+        bool terminal = isatty(STDERR_FILENO);
+
+        fprintf(stderr, "%s%lu nodes  (%.3f Gnps)  %zu/%zu positions  ETA %s%s",
+                terminal ? "\r\33[K" : "", nodes + progress.resumed_nodes, current_rate / 1.0e9,
+                entries, progress.pool_size, eta, terminal ? "" : "\n");
+
+        fflush(stderr);
+        progress.reported = terminal;
 }
 
 
-int main(int argc, char* argv[])
+Nodes threaded_perft(PerftJob const jobs[], size_t number_of_jobs, size_t number_of_threads,
+                     PerftCallback callback, void* context, MoveStatistics stats[], PerftCheckpoint* checkpoint)
 {
-        init_bitboard_tables();
+        assert(number_of_threads > 0);
+        assert(number_of_threads <= MaximumThreads);
+        assert(!(checkpoint && stats) && "checkpoints only hold node counts!");
 
-        if (argc == 2 && strcmp(argv[1], "--bench") == 0) {
-                bench();
-                return 0;
+        // A resumed run must split the work exactly like the run that made the checkpoint.
+        auto pool_threads = number_of_threads;
+
+        if (checkpoint) {
+                if (checkpoint->pool_threads == 0) checkpoint->pool_threads = number_of_threads;
+                pool_threads = checkpoint->pool_threads;
         }
 
-        if (argc != 3) {
-                fprintf(stderr,
-                        "Usage: %s <FEN> <depth>\n\n"
-                        " - FEN: position for perft test.\n"
-                        " - depth: non-negative depth of perft test.\n",
-                        argv[0]);
-                return 1;
+        PositionPool position_pool = {};
+        build_position_pool(jobs, number_of_jobs, pool_threads, position_pool);
+
+        auto pool_size = position_pool.size;
+
+        // Finished entries are indices into the pool, so they only fit the pool they were made for.
+        bool fits_pool = !checkpoint || checkpoint->number_of_finished == 0 || checkpoint->pool_size == pool_size;
+
+        for (size_t i = 0; fits_pool && checkpoint && i < checkpoint->number_of_finished; ++i) {
+                fits_pool = checkpoint->finished_entries[i] < pool_size;
         }
 
-        bool white_to_move, ok;
-        auto board = parse_fen(argv[1], &white_to_move, &ok);
+        if (!fits_pool) {
+                fprintf(stderr, "error: checkpoint %s is for a different pool.\n", checkpoint->path);
+                checkpoint->failed = true;
 
-        if (!ok) {
-                fprintf(stderr, "error: invalid fen.\n");
-                return 1;
+                free(position_pool.tasks);
+                return 0;
         }
 
-        // FIXME: check position is actually legal, not just parses correctly.
+        PerftScheduler scheduler = {
+                .task_buffer = position_pool.tasks,
+                .buffer_size = position_pool.size,
+                .jobs = new PerftJobState[number_of_jobs],
+                .entries = new PerftEntryState[pool_size],
+                .callback = callback,
+                .context = context,
+                .stats = stats,
+                .workers = new PerftWorker[number_of_threads],
+                .number_of_workers = number_of_threads,
+        };
 
-        char* end_of_depth_string;
-        auto depth = strtol(argv[2], &end_of_depth_string, 10);
+        atomic_init(&scheduler.buffer_done, 0);
+        atomic_init(&scheduler.idle_workers, 0);
+        atomic_init(&scheduler.result, 0);
 
-        if (depth < 0 || *end_of_depth_string) {
-                fprintf(stderr, "error: invalid depth.\n");
-                return 1;
+        for (size_t i = 0; i < number_of_jobs; ++i) {
+                atomic_init(&scheduler.jobs[i].nodes, 0);
+                atomic_init(&scheduler.jobs[i].seconds, 0.0);
+                atomic_init(&scheduler.jobs[i].outstanding, 0);
+                if (stats) stats[i] = {};
         }
 
-        Nodes nodes;
-        auto t1 = get_time_from_os();
+        for (size_t i = 0; i < pool_size; ++i) {
+                position_pool.tasks[i].entry = i;
+                atomic_init(&scheduler.entries[i].nodes, 0);
+                atomic_init(&scheduler.entries[i].outstanding, 1);
+        }
 
-        if (depth < 3) {
-                if (!depth) nodes = 1; // definition of perft 1
-                else        nodes = perft(board, depth);
+        PerftProgress progress = { .start = get_time_from_os(), .pool_size = pool_size };
+
+        // Skip the entries finished before resuming, keeping the rest in order.
+        if (checkpoint && checkpoint->number_of_finished) {
+                for (size_t i = 0; i < checkpoint->number_of_finished; ++i) {
+                        auto index = checkpoint->finished_entries[i];
+                        auto nodes = checkpoint->finished_nodes[i];
+
+                        auto& entry = scheduler.entries[index];
+
+                        if (entry.outstanding == 0) continue; // duplicate
+
+                        entry.nodes = nodes;
+                        entry.outstanding = 0;
+
+                        scheduler.jobs[position_pool.tasks[index].job].nodes += nodes;
+                        scheduler.result += nodes;
+
+                        progress.resumed_entries += 1;
+                        progress.resumed_nodes += nodes;
+                }
+
+                size_t remaining = 0;
+
+                for (size_t i = 0; i < pool_size; ++i) {
+                        if (scheduler.entries[i].outstanding) position_pool.tasks[remaining++] = position_pool.tasks[i];
+                }
+
+                scheduler.buffer_size = remaining;
+        }
+
+        atomic_init(&scheduler.pending, scheduler.buffer_size);
+        mtx_init(&scheduler.stats_lock, mtx_plain);
+
+        for (size_t i = 0; i < scheduler.buffer_size; ++i) {
+                scheduler.jobs[position_pool.tasks[i].job].outstanding += 1;
+        }
+
+        // Jobs without any moves (or fully counted before resuming) are already finished.
+        for (size_t i = 0; i < number_of_jobs; ++i) {
+                auto& job = scheduler.jobs[i];
+                if (job.outstanding == 0 && callback) callback(context, i, job.nodes, job.seconds);
+        }
+
+        for (size_t i = 0; i < number_of_threads; ++i) {
+                auto& worker = scheduler.workers[i];
+
+                worker.scheduler = &scheduler;
+                worker.index = i;
+                worker.head = 0;
+                atomic_init(&worker.size, 0);
+                atomic_init(&worker.nodes_done, 0);
+                atomic_init(&worker.entries_done, 0);
+                atomic_init(&worker.entry_nodes_done, 0);
+                mtx_init(&worker.lock, mtx_plain);
         }
 
-        else {
-                auto cpu_core_count = sysconf(_SC_NPROCESSORS_ONLN);
-                printf("Running multi-threaded perft on %ld threads.\n\n", cpu_core_count);
+        start_pool_run(scheduler, number_of_threads);
+
+        // Meanwhile, this thread writes the checkpoints and reports progress.
+        bool report = ProgressInterval > 0;
+
+        if (checkpoint || report) {
+                auto fingerprint = checkpoint_fingerprint(jobs, number_of_jobs);
+                auto last_write = get_time_from_os();
+                auto last_report = last_write;
+
+                while (scheduler.pending > 0) {
+                        timespec pause = { .tv_sec = 0, .tv_nsec = 100'000'000 };
+                        thrd_sleep(&pause, nullptr);
+
+                        auto now = get_time_from_os();
+
+                        if (checkpoint && now - last_write >= checkpoint->interval) {
+                                write_checkpoint(scheduler, *checkpoint, fingerprint, pool_size);
+                                last_write = get_time_from_os();
+                        }
+
+                        if (report && now - last_report >= ProgressInterval) {
+                                report_progress(scheduler, progress, now);
+                                last_report = now;
+                        }
+                }
 
-                nodes = threaded_perft(board, depth, cpu_core_count);
+                if (progress.reported) fprintf(stderr, "\n");
         }
 
-        auto t2 = get_time_from_os();
+        wait_for_pool_run();
 
-        auto seconds = t2 - t1;
-        auto nodes_per_second = nodes / seconds;
+        for (size_t i = 0; i < number_of_threads; ++i) mtx_destroy(&scheduler.workers[i].lock);
 
-        printf("Result:            %lu\n", nodes);
-        printf("Time taken:        %.3f seconds.\n", t2 - t1);
+        if (checkpoint) write_checkpoint(scheduler, *checkpoint, checkpoint_fingerprint(jobs, number_of_jobs), pool_size);
 
-        if (nodes_per_second < 1.0e9) printf("Nodes per second:  %.0f million.\n", nodes_per_second / 1.0e6);
-        else                          printf("Nodes per second:  %.3f billion.\n", nodes_per_second / 1.0e9);
+        mtx_destroy(&scheduler.stats_lock);
+
+        delete[] scheduler.workers;
+        delete[] scheduler.entries;
+        delete[] scheduler.jobs;
+        free(position_pool.tasks);
+
+        return scheduler.result;
+}
+
+
+Nodes threaded_perft(Board const& board, Depth depth, size_t number_of_threads)
+{
+        PerftJob job = { board, depth };
+        return threaded_perft(&job, 1, number_of_threads);
 }
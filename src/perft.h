@@ -0,0 +1,86 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "board.h"
+#include "movegen.h"
+
+typedef unsigned Depth;
+typedef uint64_t Nodes;
+typedef double Seconds;
+
+
+Nodes perft(Board const& pos, Depth depth); // requires depth >= 1
+void perft_statistics(Board const& pos, Depth depth, MoveStatistics& stats);
+Nodes threaded_perft(Board const& board, Depth depth, size_t number_of_threads);
+
+double get_time_from_os();
+
+// If positive, `threaded_perft` prints its progress to stderr at this interval.
+extern Seconds ProgressInterval;
+
+
+// Expand a set of positions one ply at a time until it holds at least `target` positions. Using
+// the branching factor observed so far, we stop early if the next ply would overshoot the target
+// by more than the current ply falls short of it. `expand(size)` expands the set by one ply and
+// updates its size, or returns false if there is nothing left to expand.
+
+template <typename Expand>
+void expand_to_target(size_t size, size_t target, Expand&& expand)
+{
+        double branching_factor = 0.0; // unknown until the first expansion
+
+        while (size > 0 && size < target) {
+                double predicted_size = size * branching_factor;
+                if (predicted_size * size > (double) target * target) break;
+
+                auto previous_size = size;
+                if (!expand(size)) break;
+
+                branching_factor = (double) size / previous_size;
+        }
+}
+
+
+// Multiple positions (jobs) can be counted at once on the same threads, which report each job
+// through the callback as soon as it is finished, with the total time all threads spent on it.
+// Note the callback is called from worker threads.
+// If an array for the extended statistics of each job is given, these are collected too.
+
+struct PerftJob {
+        Board board;
+        Depth depth;
+};
+
+typedef void (*PerftCallback)(void* context, size_t job, Nodes nodes, Seconds seconds);
+
+struct PerftCheckpoint;
+
+Nodes threaded_perft(PerftJob const jobs[], size_t number_of_jobs, size_t number_of_threads,
+                     PerftCallback callback = nullptr, void* context = nullptr,
+                     MoveStatistics stats[] = nullptr, PerftCheckpoint* checkpoint = nullptr);
+
+
+// Long runs can be checkpointed to a small text file, listing the node count of every finished
+// entry of the position pool. The file is rewritten periodically by the thread that started the
+// run, so workers never wait for it. When resuming, the pool is rebuilt for the same number of
+// threads as when the checkpoint was made, and the finished entries are skipped.
+// Checkpoints only hold node counts, so they can't be combined with extended statistics.
+
+struct PerftCheckpoint {
+        char const* path;
+        Seconds     interval;       // between writes, the last write is always at the end of the run
+        size_t      pool_threads;   // thread count the position pool is built for, 0 for the run's own
+        size_t      pool_size;      // of the run that made the checkpoint, 0 if nothing was loaded
+        bool        failed;         // set by `threaded_perft` if the checkpoint doesn't fit its pool
+
+        // Pool entries already finished, as loaded by `load_checkpoint`.
+        size_t      number_of_finished;
+        size_t*     finished_entries;
+        Nodes*      finished_nodes;
+};
+
+// Load the finished entries of a previous run, if its checkpoint file exists. Fails if the file is
+// invalid, or was made for different jobs. A checkpoint whose pool differs from the one rebuilt by
+// `threaded_perft` fails the run instead, which then returns 0 and sets `failed`.
+bool load_checkpoint(PerftCheckpoint& checkpoint, PerftJob const jobs[], size_t number_of_jobs);
+void free_checkpoint(PerftCheckpoint& checkpoint);
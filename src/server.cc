@@ -0,0 +1,582 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "board.h"
+#include "distributed.h"
+#include "fen.h"
+#include "perft.h"
+#include "server.h"
+#include "uci.h"
+
+constexpr char const* StartFEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+constexpr size_t MaximumClients = 1024;
+constexpr size_t MaximumLineLength = 1 << 20; // long enough for a whole game of moves
+constexpr size_t MaximumUnsentLength = 1 << 20; // of unsent replies, before a client's commands are no longer read
+constexpr size_t ReplyLength = 128;
+constexpr size_t NoJob = SIZE_MAX;
+
+
+// Replies are queued while a client has queries in the pending batch, so that they stay in order.
+struct Reply {
+        size_t job; // whose count is still missing, or `NoJob` once the text is ready
+        char   text[ReplyLength];
+};
+
+struct Client {
+        bool    active;   // whether the slot is in use
+        int     input, output;
+        bool    closing;  // once its jobs are counted and its replies are sent
+        bool    lost;     // the output failed, so its replies are dropped
+        size_t  jobs;     // queued or being counted
+
+        char*   buffer;   // received bytes of incomplete lines
+        size_t  length;
+        size_t  capacity;
+
+        Board   board;
+        bool    white_to_move;
+
+        Reply*  replies;
+        size_t  first_reply;
+        size_t  number_of_replies;
+        size_t  replies_capacity;
+
+        char*   unsent;   // replies ready to be sent, when the client can take them
+        size_t  unsent_length;
+        size_t  unsent_capacity;
+};
+
+// A batch of jobs, with the client and reply of each job.
+struct Batch {
+        PerftJob* jobs;
+        size_t*   client_of_job;
+        size_t*   reply_of_job;
+        size_t    number_of_jobs;
+        size_t    capacity;
+};
+
+struct Server {
+        Client*   clients;           // slots, which never move as jobs refer to them
+        size_t    number_of_clients; // up to the last active slot
+
+        // Queries are collected in one batch while the other is counted on a thread of its own, so
+        // that the poll loop keeps handling commands and connections meanwhile.
+        Batch     batches[2];
+        size_t    collecting;        // index of the batch collecting queries
+        bool      counting;          // the other batch is being counted
+        bool      counted;           // set by the counting thread when it is finished
+        thrd_t    counter;
+        size_t    number_of_threads;
+
+        int       wakeup[2];         // pipe, written to when replies are ready, to interrupt poll
+        mtx_t     lock;              // for the clients, whose replies jobs fill in from worker threads
+};
+
+
+bool add_client(Server& server, int input, int output)
+{
+        size_t index = 0;
+        while (index < server.number_of_clients && server.clients[index].active) ++index;
+
+        if (index == MaximumClients) return false;
+        if (index == server.number_of_clients) server.number_of_clients += 1;
+
+        Board board;
+        FENInfo info;
+        parse_fen(StartFEN, board, info);
+
+        server.clients[index] = {
+                .active = true,
+                .input = input,
+                .output = output,
+                .closing = false,
+                .lost = false,
+                .jobs = 0,
+                .buffer = nullptr,
+                .length = 0,
+                .capacity = 0,
+                .board = board,
+                .white_to_move = true,
+                .replies = nullptr,
+                .first_reply = 0,
+                .number_of_replies = 0,
+                .replies_capacity = 0,
+                .unsent = nullptr,
+                .unsent_length = 0,
+                .unsent_capacity = 0,
+        };
+
+        return true;
+}
+
+
+void remove_client(Server& server, size_t index)
+{
+        auto& client = server.clients[index];
+
+        if (client.input != STDIN_FILENO) close(client.input);
+
+        free(client.buffer);
+        free(client.replies);
+        free(client.unsent);
+
+        client.active = false;
+        while (server.number_of_clients > 0 && !server.clients[server.number_of_clients - 1].active) --server.number_of_clients;
+}
+
+
+// Move the replies that are ready to the unsent output, up to the first one still waiting for its job.
+void flush_replies(Client& client)
+{
+        while (client.first_reply < client.number_of_replies) {
+                auto& reply = client.replies[client.first_reply];
+                if (reply.job != NoJob) return;
+
+                size_t length = strlen(reply.text);
+
+                // A client that went away just misses its replies.
+                if (!client.lost) {
+                        if (client.unsent_capacity - client.unsent_length < length + 1) {
+                                client.unsent_capacity = client.unsent_capacity ? 2 * client.unsent_capacity : 4096;
+                                client.unsent = (char*) realloc(client.unsent, client.unsent_capacity);
+                                assert(client.unsent != nullptr && "server allocation failed!");
+                        }
+
+                        memcpy(client.unsent + client.unsent_length, reply.text, length);
+                        client.unsent[client.unsent_length + length] = '\n';
+                        client.unsent_length += length + 1;
+                }
+
+                client.first_reply += 1;
+        }
+
+        client.first_reply = client.number_of_replies = 0;
+}
+
+
+// Send as much of the unsent output as the client takes without blocking. Sockets are non-blocking, so
+// that a client which doesn't read its replies only holds up itself.
+void write_output(Client& client)
+{
+        auto n = write(client.output, client.unsent, client.unsent_length);
+
+        if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+
+                client.lost = true;
+                client.closing = true;
+                client.unsent_length = 0;
+                return;
+        }
+
+        client.unsent_length -= n;
+        memmove(client.unsent, client.unsent + n, client.unsent_length);
+}
+
+
+Reply& queue_reply(Client& client)
+{
+        if (client.number_of_replies == client.replies_capacity) {
+                client.replies_capacity = client.replies_capacity ? 2 * client.replies_capacity : 16;
+                client.replies = (Reply*) realloc(client.replies, client.replies_capacity * sizeof(Reply));
+                assert(client.replies != nullptr && "server allocation failed!");
+        }
+
+        auto& reply = client.replies[client.number_of_replies++];
+        reply.job = NoJob;
+
+        return reply;
+}
+
+
+__attribute__((format(printf, 2, 3)))
+void reply(Client& client, char const* format, ...)
+{
+        auto& reply = queue_reply(client);
+
+        va_list arguments;
+        va_start(arguments, format);
+        vsnprintf(reply.text, ReplyLength, format, arguments);
+        va_end(arguments);
+
+        flush_replies(client);
+}
+
+
+void queue_perft(Server& server, size_t index, Depth depth)
+{
+        auto& client = server.clients[index];
+        auto& batch = server.batches[server.collecting];
+
+        if (batch.number_of_jobs == batch.capacity) {
+                batch.capacity = batch.capacity ? 2 * batch.capacity : 64;
+
+                batch.jobs = (PerftJob*) realloc(batch.jobs, batch.capacity * sizeof(PerftJob));
+                batch.client_of_job = (size_t*) realloc(batch.client_of_job, batch.capacity * sizeof(size_t));
+                batch.reply_of_job = (size_t*) realloc(batch.reply_of_job, batch.capacity * sizeof(size_t));
+
+                assert(batch.jobs && batch.client_of_job && batch.reply_of_job && "server allocation failed!");
+        }
+
+        auto job = batch.number_of_jobs++;
+
+        batch.jobs[job] = { client.board, depth };
+        batch.client_of_job[job] = index;
+        batch.reply_of_job[job] = client.number_of_replies;
+
+        queue_reply(client).job = job;
+        client.jobs += 1;
+}
+
+
+// Interrupt the poll loop, e.g. to send replies that are ready. If the pipe is full, it is about
+// to wake up anyway, so the write may fail.
+void wake_server(Server& server)
+{
+        char byte = 0;
+        [[maybe_unused]] auto written = write(server.wakeup[1], &byte, 1);
+}
+
+
+void report_server_job(void* context, size_t job, Nodes nodes, Seconds)
+{
+        auto& server = *(Server*) context;
+        mtx_lock(&server.lock);
+
+        auto& batch = server.batches[!server.collecting];
+        auto& client = server.clients[batch.client_of_job[job]];
+        auto& reply = client.replies[batch.reply_of_job[job]];
+
+        snprintf(reply.text, ReplyLength, "nodes %lu", nodes);
+        reply.job = NoJob;
+        client.jobs -= 1;
+
+        flush_replies(client);
+        mtx_unlock(&server.lock);
+
+        wake_server(server);
+}
+
+
+int count_batch(void* context)
+{
+        auto& server = *(Server*) context;
+        auto& batch = server.batches[!server.collecting];
+
+        threaded_perft(batch.jobs, batch.number_of_jobs, server.number_of_threads, report_server_job, &server);
+
+        mtx_lock(&server.lock);
+        server.counted = true;
+        mtx_unlock(&server.lock);
+
+        wake_server(server);
+        return 0;
+}
+
+
+// Start counting the collected batch, unless a batch is still being counted.
+bool start_batch(Server& server)
+{
+        if (server.counting || server.batches[server.collecting].number_of_jobs == 0) return true;
+
+        server.collecting = !server.collecting;
+        server.counting = true;
+
+        return thrd_create(&server.counter, count_batch, &server) == thrd_success;
+}
+
+
+void finish_batch(Server& server)
+{
+        thrd_join(server.counter, nullptr);
+
+        server.batches[!server.collecting].number_of_jobs = 0;
+        server.counting = server.counted = false;
+}
+
+
+// Split off the next word of a command.
+char* next_word(char*& line)
+{
+        while (*line == ' ' || *line == '\t') ++line;
+
+        auto word = line;
+        while (*line && *line != ' ' && *line != '\t') ++line;
+
+        if (*line) *line++ = '\0';
+        return word;
+}
+
+
+void set_position(Client& client, char* arguments)
+{
+        auto kind = next_word(arguments);
+
+        char const* begin;
+        char const* end;
+
+        // The FEN runs up to the moves, if any.
+        auto moves = strstr(arguments, "moves");
+        while (moves && moves != arguments && moves[-1] != ' ' && moves[-1] != '\t') moves = strstr(moves + 1, "moves");
+
+        if (strcmp(kind, "startpos") == 0) {
+                begin = StartFEN, end = StartFEN + strlen(StartFEN);
+        }
+
+        else if (strcmp(kind, "fen") == 0) {
+                begin = arguments, end = moves ? moves : arguments + strlen(arguments);
+        }
+
+        else return reply(client, "error expected startpos or fen");
+
+        Board board;
+        FENInfo info;
+
+        auto error = parse_fen(begin, end, board, info);
+        if (error != FENOk) return reply(client, "error invalid fen: %s", FENErrorMessages[error]);
+
+        bool white_to_move = info.white_to_move;
+
+        if (moves) {
+                next_word(moves); // "moves" itself
+
+                for (auto move = next_word(moves); *move; move = next_word(moves)) {
+                        if (!make_uci_move(board, white_to_move, move, strlen(move), board)) {
+                                return reply(client, "error illegal move %.16s", move);
+                        }
+
+                        white_to_move = !white_to_move;
+                }
+        }
+
+        client.board = board;
+        client.white_to_move = white_to_move;
+}
+
+
+void handle_command(Server& server, size_t index, char* line)
+{
+        auto& client = server.clients[index];
+        auto command = next_word(line);
+
+        if (*command == '\0') return;
+
+        if (strcmp(command, "position") == 0) return set_position(client, line);
+
+        if (strcmp(command, "go") == 0) {
+                unsigned depth;
+                int length = 0;
+
+                if (sscanf(line, " perft %u %n", &depth, &length) != 1 || line[length] != '\0') {
+                        return reply(client, "error expected go perft <depth>");
+                }
+
+                if (depth == 0) return reply(client, "nodes 1"); // definition of perft 0
+                return queue_perft(server, index, depth);
+        }
+
+        if (strcmp(command, "isready") == 0) return reply(client, "readyok");
+        if (strcmp(command, "quit") == 0) { client.closing = true; return; }
+
+        reply(client, "error unknown command %.32s", command);
+}
+
+
+// Read what the client sent, and handle all complete lines.
+void read_commands(Server& server, size_t index)
+{
+        auto& client = server.clients[index];
+
+        if (client.capacity - client.length < 4096) {
+                client.capacity = client.capacity ? 2 * client.capacity : 8192;
+                client.buffer = (char*) realloc(client.buffer, client.capacity);
+                assert(client.buffer != nullptr && "server allocation failed!");
+        }
+
+        auto n = read(client.input, client.buffer + client.length, client.capacity - client.length);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+
+        if (n <= 0) {
+                client.closing = true;
+                return;
+        }
+
+        client.length += n;
+
+        auto line = client.buffer;
+        auto end = client.buffer + client.length;
+
+        while (!client.closing) {
+                auto newline = (char*) memchr(line, '\n', end - line);
+                if (newline == nullptr) break;
+
+                if (newline > line && newline[-1] == '\r') newline[-1] = '\0';
+                *newline = '\0';
+
+                handle_command(server, index, line);
+                line = newline + 1;
+        }
+
+        client.length = end - line;
+        memmove(client.buffer, line, client.length);
+
+        if (client.length > MaximumLineLength) {
+                reply(client, "error line too long");
+                client.closing = true;
+        }
+}
+
+
+bool run_server(char const* address, size_t number_of_threads)
+{
+        Server server = {};
+        server.clients = new Client[MaximumClients];
+        server.number_of_threads = number_of_threads;
+        mtx_init(&server.lock, mtx_plain);
+
+        if (pipe(server.wakeup) < 0) {
+                fprintf(stderr, "error: pipe: %s.\n", strerror(errno));
+                return false;
+        }
+
+        fcntl(server.wakeup[0], F_SETFL, O_NONBLOCK);
+        fcntl(server.wakeup[1], F_SETFL, O_NONBLOCK);
+
+        int listener = -1;
+
+        if (address) {
+                listener = open_socket(address, true);
+                if (listener < 0) return false;
+
+                // A write to a lost client should fail, instead of killing the server.
+                signal(SIGPIPE, SIG_IGN);
+
+                printf("Serving perft on %s, counting on %zu threads.\n", address, number_of_threads);
+                fflush(stdout);
+        }
+
+        // Stdin and stdout are left blocking, as they are shared with other processes, and the only
+        // client they could hold up is their own.
+        else add_client(server, STDIN_FILENO, STDOUT_FILENO);
+
+        // Each client has up to two entries, to read its commands and to send its replies.
+        pollfd fds[2 * MaximumClients + 2];
+        size_t client_of_fd[2 * MaximumClients + 2];
+        bool ok = true;
+
+        mtx_lock(&server.lock);
+
+        while (listener >= 0 || server.number_of_clients > 0 || server.counting) {
+                size_t number_of_fds = 0;
+
+                fds[number_of_fds++] = { .fd = server.wakeup[0], .events = POLLIN, .revents = 0 };
+                if (listener >= 0) fds[number_of_fds++] = { .fd = listener, .events = POLLIN, .revents = 0 };
+
+                auto first_client_fd = number_of_fds;
+
+                for (size_t i = 0; i < server.number_of_clients; ++i) {
+                        auto& client = server.clients[i];
+                        if (!client.active) continue;
+
+                        // Stop reading the commands of a client that doesn't read its replies.
+                        if (!client.closing && client.unsent_length < MaximumUnsentLength) {
+                                client_of_fd[number_of_fds] = i;
+                                fds[number_of_fds++] = { .fd = client.input, .events = POLLIN, .revents = 0 };
+                        }
+
+                        if (client.unsent_length > 0) {
+                                client_of_fd[number_of_fds] = i;
+                                fds[number_of_fds++] = { .fd = client.output, .events = POLLOUT, .revents = 0 };
+                        }
+                }
+
+                // Let the counting thread report its jobs while waiting.
+                mtx_unlock(&server.lock);
+                int polled = poll(fds, number_of_fds, -1);
+                mtx_lock(&server.lock);
+
+                if (polled < 0) {
+                        if (errno == EINTR) continue;
+
+                        fprintf(stderr, "error: poll: %s.\n", strerror(errno));
+                        ok = false;
+                        break;
+                }
+
+                if (fds[0].revents) {
+                        char bytes[64];
+                        while (read(server.wakeup[0], bytes, sizeof(bytes)) > 0);
+                }
+
+                for (size_t i = first_client_fd; i < number_of_fds; ++i) {
+                        if (!fds[i].revents) continue;
+
+                        auto& client = server.clients[client_of_fd[i]];
+
+                        if (fds[i].events & POLLIN) read_commands(server, client_of_fd[i]);
+                        else if (client.unsent_length > 0) write_output(client);
+                }
+
+                if (listener >= 0 && fds[1].revents & POLLIN) {
+                        int fd = accept(listener, nullptr, nullptr);
+
+                        if (fd >= 0) {
+                                fcntl(fd, F_SETFL, O_NONBLOCK);
+                                if (!add_client(server, fd, fd)) close(fd);
+                        }
+                }
+
+                // Count all queries that arrived together as one batch, each is answered as it
+                // finishes. Queries that arrive meanwhile are counted in the next batch.
+                if (server.counted) finish_batch(server);
+
+                if (!start_batch(server)) {
+                        fprintf(stderr, "error: can't start a thread to count on.\n");
+                        server.counting = false;
+                        ok = false;
+                        break;
+                }
+
+                // Clients are only removed once their jobs are counted, as the jobs refer to them.
+                for (size_t i = 0; i < server.number_of_clients; ++i) {
+                        auto& client = server.clients[i];
+
+                        if (client.active && client.closing && client.jobs == 0 && client.unsent_length == 0) {
+                                remove_client(server, i);
+                        }
+                }
+        }
+
+        mtx_unlock(&server.lock);
+        if (server.counting) finish_batch(server);
+
+        if (listener >= 0) close(listener);
+        close(server.wakeup[0]);
+        close(server.wakeup[1]);
+
+        for (size_t i = 0; i < server.number_of_clients; ++i) {
+                if (server.clients[i].active) remove_client(server, i);
+        }
+
+        for (auto& batch : server.batches) {
+                free(batch.jobs);
+                free(batch.client_of_job);
+                free(batch.reply_of_job);
+        }
+
+        delete[] server.clients;
+        mtx_destroy(&server.lock);
+
+        return ok;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ *   Server mode, which answers perft queries for as long as it runs, so that many small queries
+ *   don't each pay for starting a process. Commands are read line by line in the style of UCI,
+ *   from stdin if no address is given, or from any number of clients on "host:port" or
+ *   "unix:<path>" (see distributed.h):
+ *
+ *       position startpos [moves <move>...]
+ *       position fen <FEN> [moves <move>...]
+ *       go perft <depth>                        replies "nodes <count>"
+ *       isready                                 replies "readyok"
+ *       quit
+ *
+ *   Invalid commands are answered with "error <message>". Each client has its own position, and
+ *   gets its replies in the order of its commands.
+ *
+ *   All queries that arrive together, from one client or many, are counted as a single batch of
+ *   jobs on the same threads (see `threaded_perft`), and each is answered as soon as it finishes.
+ *   The batch is counted on a thread of its own, so that other commands and new clients are still
+ *   handled meanwhile, and queries that arrive while a batch is running are counted in the next
+ *   one. Replies are sent as each client is ready for them, so that a client which doesn't read
+ *   its replies only holds up itself. The transposition table, if enabled with `--hash`, is kept
+ *   between queries.
+ */
+
+bool run_server(char const* address, size_t number_of_threads);
@@ -0,0 +1,250 @@
+#include <atomic>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "fen.h"
+#include "perft.h"
+#include "suite.h"
+
+#define atomic(T) std::atomic<T>
+
+/*
+ *   Runner for perft suites in EPD format, where each line holds a position followed by the expected
+ *   results at each depth, e.g.
+ *
+ *       rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - ;D1 20 ;D2 400 ;D3 8902
+ *
+ *   Rather than running the positions one after another, every depth of every position is a job of
+ *   a single threaded perft, so small positions fill the gaps left by the large ones. Each line is
+ *   reported as soon as all its depths are finished.
+ */
+
+// Positions parsed at a time.
+constexpr size_t SuiteReadSize = 1024;
+
+struct SuiteLine {
+        size_t  line_number;
+        char*   fen;
+        size_t  first_job;
+        size_t  number_of_jobs;
+};
+
+struct alignas(64) SuiteLineState {
+        atomic(size_t)  outstanding;
+        atomic(Nodes)   nodes;
+        atomic(Seconds) seconds;
+};
+
+struct SuiteContext {
+        SuiteLine*      lines;
+        SuiteLineState* states;
+        size_t*         line_of_job;
+        Depth*          depths;
+        Nodes*          expected;
+        Nodes*          results;
+        size_t          number_of_threads;
+        atomic(size_t)  failed;
+};
+
+
+// Growable array, for the lines and jobs of a suite of unknown length.
+template <typename T>
+void append(T*& array, size_t& size, size_t& capacity, T const& value)
+{
+        if (size == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                array = (T*) realloc(array, capacity * sizeof(T));
+                assert(array != nullptr && "suite allocation failed!");
+        }
+
+        array[size++] = value;
+}
+
+
+void report_suite_job(void* opaque_context, size_t job, Nodes nodes, Seconds seconds)
+{
+        auto& context = *(SuiteContext*) opaque_context;
+        auto index = context.line_of_job[job];
+
+        auto& line = context.lines[index];
+        auto& state = context.states[index];
+
+        context.results[job] = nodes;
+        atomic_fetch_add(&state.nodes, nodes);
+        atomic_fetch_add(&state.seconds, seconds);
+
+        if (atomic_fetch_sub(&state.outstanding, 1) != 1) return;
+
+        // This was the last depth of the line, so check all its results.
+        bool passed = true;
+
+        for (size_t i = line.first_job; i < line.first_job + line.number_of_jobs; ++i) {
+                if (context.results[i] == context.expected[i]) continue;
+
+                printf("line %-5zu FAIL  depth %u: expected %lu, got %lu\n",
+                       line.line_number, context.depths[i], context.expected[i], context.results[i]);
+                passed = false;
+        }
+
+        if (!passed) context.failed += 1;
+
+        // The time is summed over all threads, so estimate the throughput as if the line had all threads.
+        Seconds line_seconds = state.seconds / context.number_of_threads;
+        Nodes line_nodes = state.nodes;
+
+        printf("line %-5zu %s  %12lu nodes  (%6.3f Gnps)  %s\n", line.line_number, passed ? "pass" : "FAIL",
+               line_nodes, line_seconds > 0 ? line_nodes / line_seconds / 1.0e9 : 0.0, line.fen);
+
+        fflush(stdout);
+}
+
+
+bool run_suite(char const* path, Depth max_depth, size_t number_of_threads)
+{
+        FENReader reader;
+        if (!open_fen_file(path, reader)) return false;
+
+        SuiteLine* lines = nullptr;
+        size_t number_of_lines = 0, lines_capacity = 0;
+
+        PerftJob* jobs = nullptr;
+        size_t number_of_jobs = 0, jobs_capacity = 0;
+
+        size_t* line_of_job = nullptr;
+        Nodes* expected = nullptr;
+        size_t line_of_job_size = 0, line_of_job_capacity = 0;
+        size_t expected_size = 0, expected_capacity = 0;
+
+        size_t invalid_lines = 0;
+
+        auto boards = new Board[SuiteReadSize];
+        auto infos = new FENInfo[SuiteReadSize];
+
+        while (!reader.at_end()) {
+                auto count = read_fens(reader, boards, infos, SuiteReadSize);
+
+                for (size_t index = 0; index < count; ++index) {
+                        auto& board = boards[index];
+                        auto& info = infos[index];
+
+                        // The operations aren't NUL-terminated in the mapped file.
+                        auto results = strndup(info.operations, info.operations_length);
+
+                        if (*results != ';') {
+                                fprintf(stderr, "line %zu: no perft results.\n", info.line_number);
+                                invalid_lines += 1;
+                                free(results);
+                                continue;
+                        }
+
+                        SuiteLine line = {
+                                .line_number = info.line_number,
+                                .fen = strndup(info.fen, info.fen_length),
+                                .first_job = number_of_jobs,
+                                .number_of_jobs = 0,
+                        };
+
+                        // Parse all ";D<depth> <nodes>" fields. A malformed field fails the whole line,
+                        // so that none of its jobs are counted.
+                        bool valid = true;
+
+                        for (auto field = strtok(results, ";"); field; field = strtok(nullptr, ";")) {
+                                unsigned depth;
+                                unsigned long nodes;
+                                int length = 0;
+
+                                if (sscanf(field, " D%u %lu %n", &depth, &nodes, &length) != 2 || field[length] != '\0') {
+                                        fprintf(stderr, "line %zu: invalid field \"%s\".\n", info.line_number, field);
+                                        valid = false;
+                                        break;
+                                }
+
+                                if (depth > max_depth) continue;
+
+                                append(jobs, number_of_jobs, jobs_capacity, { board, depth });
+                                append(line_of_job, line_of_job_size, line_of_job_capacity, number_of_lines);
+                                append(expected, expected_size, expected_capacity, (Nodes) nodes);
+                                line.number_of_jobs += 1;
+                        }
+
+                        free(results);
+
+                        if (!valid) {
+                                number_of_jobs -= line.number_of_jobs;
+                                line_of_job_size -= line.number_of_jobs;
+                                expected_size -= line.number_of_jobs;
+
+                                invalid_lines += 1;
+                                free(line.fen);
+                                continue;
+                        }
+
+                        if (line.number_of_jobs == 0) {
+                                free(line.fen);
+                                continue;
+                        }
+
+                        append(lines, number_of_lines, lines_capacity, line);
+                }
+
+                if (reader.error != FENOk) {
+                        fprintf(stderr, "line %zu: invalid fen: %s.\n", reader.line_number, FENErrorMessages[reader.error]);
+                        invalid_lines += 1;
+                }
+        }
+
+        delete[] boards;
+        delete[] infos;
+        close_fen_file(reader);
+
+        SuiteContext context = {
+                .lines = lines,
+                .states = new SuiteLineState[number_of_lines],
+                .line_of_job = line_of_job,
+                .depths = new Depth[number_of_jobs],
+                .expected = expected,
+                .results = new Nodes[number_of_jobs],
+                .number_of_threads = number_of_threads,
+        };
+
+        atomic_init(&context.failed, invalid_lines);
+
+        for (size_t i = 0; i < number_of_lines; ++i) {
+                atomic_init(&context.states[i].outstanding, lines[i].number_of_jobs);
+                atomic_init(&context.states[i].nodes, 0);
+                atomic_init(&context.states[i].seconds, 0.0);
+        }
+
+        for (size_t i = 0; i < number_of_jobs; ++i) {
+                context.depths[i] = jobs[i].depth;
+        }
+
+        printf("Running %zu positions (%zu depths) on %zu threads.\n\n", number_of_lines, number_of_jobs, number_of_threads);
+
+        auto t1 = get_time_from_os();
+        auto nodes = threaded_perft(jobs, number_of_jobs, number_of_threads, report_suite_job, &context);
+        auto t2 = get_time_from_os();
+
+        size_t failed = context.failed;
+
+        printf("\nPassed:            %zu / %zu\n", number_of_lines + invalid_lines - failed, number_of_lines + invalid_lines);
+        printf("Nodes:             %lu\n", nodes);
+        printf("Time taken:        %.3f seconds.\n", t2 - t1);
+        printf("Nodes per second:  %.3f billion.\n", nodes / (t2 - t1) / 1.0e9);
+
+        for (size_t i = 0; i < number_of_lines; ++i) free(lines[i].fen);
+
+        delete[] context.states;
+        delete[] context.depths;
+        delete[] context.results;
+
+        free(lines);
+        free(jobs);
+        free(line_of_job);
+        free(expected);
+
+        return failed == 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+#include <stddef.h>
+#include "perft.h"
+
+// Run all positions of an EPD perft suite, up to the given depth. Returns whether all of them passed.
+bool run_suite(char const* path, Depth max_depth, size_t number_of_threads);
@@ -0,0 +1,143 @@
+#include <string.h>
+
+#include "bitboard.h"
+#include "board.h"
+#include "movegen.h"
+#include "uci.h"
+
+
+// Pawn pushes are only stored as a bitboard of destination squares, so find their initial square
+// like `make_pawn_push` does, and construct the full move.
+
+Move pawn_push_move(Board const& board, Square dest)
+{
+        Square init = dest + South;
+        if (!(board.occupied() & (OneBB << init))) init += South; // double pawn move
+
+        return M(init, dest, Pawn);
+}
+
+
+void format_square(Square sq, bool white_to_move, char* out)
+{
+        if (!white_to_move) sq ^= 56;
+
+        out[0] = 'a' + (sq & 7);
+        out[1] = '1' + (sq >> 3);
+}
+
+
+void format_move(Board const& board, Move move, bool white_to_move, char uci[UCIMoveLength])
+{
+        Square init = M_INIT(move);
+        Square dest = M_DEST(move);
+
+        format_square(init, white_to_move, uci + 0);
+        format_square(dest, white_to_move, uci + 2);
+
+        // A promotion is a pawn that is no longer a pawn after moving.
+        bool promotion = board.piece_on(init) == Pawn && M_PIECE(move) != Pawn;
+
+        uci[4] = promotion ? "..nbr.q."[M_PIECE(move)] : '\0';
+        uci[5] = '\0';
+}
+
+
+// Format a board as FEN, the inverse of `parse_fen`. The move counters aren't stored in the board,
+// so these are always written as "0 1".
+
+void format_fen(Board const& board, bool white_to_move, char fen[FENMaximumLength])
+{
+        // Flip the board back if black is to move, so that squares and colors are absolute.
+        auto white = board.our & board.occupied();
+        auto en_passant = board.en_passant();
+
+        Board absolute = board;
+
+        if (!white_to_move) {
+                absolute.x = rotate(board.x);
+                absolute.y = rotate(board.y);
+                absolute.z = rotate(board.z);
+
+                white = rotate(board.occupied() &~ board.our);
+                en_passant = rotate(en_passant);
+        }
+
+        auto out = fen;
+
+        for (Square rank = 8; rank --> 0;) {
+                unsigned empty = 0;
+
+                for (Square file = 0; file < 8; ++file) {
+                        auto sq = 8*rank + file;
+                        auto piece = absolute.piece_on(sq);
+
+                        if (piece == Empty) {
+                                empty += 1;
+                                continue;
+                        }
+
+                        if (empty) *out++ = '0' + empty, empty = 0;
+
+                        char c = ".pnbrrqk"[piece];
+                        if (white >> sq & 1) c -= 0x20; // convert to uppercase
+
+                        *out++ = c;
+                }
+
+                if (empty) *out++ = '0' + empty;
+                if (rank) *out++ = '/';
+        }
+
+        *out++ = ' ';
+        *out++ = white_to_move ? 'w' : 'b';
+        *out++ = ' ';
+
+        auto castles = absolute.extract_by_piece(Castle);
+        auto castling = out;
+
+        if (castles & (OneBB << H1)) *out++ = 'K';
+        if (castles & (OneBB << A1)) *out++ = 'Q';
+        if (castles & (OneBB << H8)) *out++ = 'k';
+        if (castles & (OneBB << A8)) *out++ = 'q';
+        if (out == castling) *out++ = '-';
+
+        *out++ = ' ';
+
+        if (en_passant) format_square(trailing_zeros(en_passant), true, out), out += 2;
+        else *out++ = '-';
+
+        strcpy(out, " 0 1");
+}
+
+
+// Rather than decoding the notation, and then checking that the move is legal, simply find the legal
+// move that is formatted the same.
+
+bool make_uci_move(Board const& board, bool white_to_move, char const* uci, size_t length, Board& child)
+{
+        if (length < 4 || length >= UCIMoveLength) return false;
+
+        auto buffer = generate_moves(board);
+        char formatted[UCIMoveLength];
+
+        for (size_t i = 0; i < buffer.size; ++i) {
+                format_move(board, buffer.moves[i], white_to_move, formatted);
+                if (strlen(formatted) != length || memcmp(formatted, uci, length) != 0) continue;
+
+                child = make_move(board, buffer.moves[i]);
+                return true;
+        }
+
+        while (buffer.pawn_pushes) {
+                auto dest = trailing_zeros_and_pop(buffer.pawn_pushes);
+
+                format_move(board, pawn_push_move(board, dest), white_to_move, formatted);
+                if (strlen(formatted) != length || memcmp(formatted, uci, length) != 0) continue;
+
+                child = make_pawn_push(board, dest);
+                return true;
+        }
+
+        return false;
+}
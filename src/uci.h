@@ -0,0 +1,19 @@
+#pragma once
+#include "board.h"
+#include "movegen.h"
+
+/*
+ *   Conversion of moves to and from UCI long algebraic notation (e.g. e2e4, e7e8q, e1g1). As boards
+ *   are stored from the perspective of the side to move, the squares of a move have to be flipped
+ *   back when black is to move.
+ */
+
+constexpr size_t UCIMoveLength = 6; // including the null terminator
+constexpr size_t FENMaximumLength = 96;
+
+Move pawn_push_move(Board const& board, Square dest);
+void format_move(Board const& board, Move move, bool white_to_move, char uci[UCIMoveLength]);
+void format_fen(Board const& board, bool white_to_move, char fen[FENMaximumLength]);
+
+// Make the move of the given `length` characters in UCI notation, returns false if it isn't legal.
+bool make_uci_move(Board const& board, bool white_to_move, char const* uci, size_t length, Board& child);
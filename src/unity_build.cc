@@ -1,4 +1,9 @@
 // Unity build
-#include "magic.cc"
-#include "movegen.cc"
-#include "perft.cc"
+#include "library_build.cc"
+#include "bench.cc"
+#include "counters.cc"
+#include "distributed.cc"
+#include "microbench.cc"
+#include "server.cc"
+#include "suite.cc"
+#include "main.cc"
@@ -0,0 +1,66 @@
+#pragma once
+#include "bitboard.h"
+#include "board.h"
+
+/*
+ *   Zobrist keys for incrementally hashing a board. As the board is flipped after every move, the
+ *   keys for enemy pieces are chosen such that flipping the board is also cheap to apply to the key:
+ *
+ *       zobrist(piece, sq, enemy) = rotate_key(zobrist(piece, sq ^ 56, ours))
+ *
+ *   and because rotating by half the key width is its own inverse, rotating the key of a board gives
+ *   exactly the key of the flipped board. The en-passant square is hashed as an `Empty` piece of its
+ *   owner, and castles are hashed as a separate piece type, so they decay to rooks like any other
+ *   change of piece type.
+ *
+ *   Only with `-DPERFT_INCREMENTAL_KEY` does the board carry its key around, updated by `make_move`
+ *   and `make_pawn_push`. Otherwise plain perft pays nothing for it.
+ */
+
+typedef uint64_t Key;
+
+
+struct ZobristTable {
+        Key keys[8][64];
+
+        constexpr ZobristTable() : keys() {
+                uint64_t state = 0x2545'f491'4f6c'dd1d;
+
+                for (auto& piece : keys) {
+                        for (auto& key : piece) {
+                                // splitmix64
+                                auto z = (state += 0x9e37'79b9'7f4a'7c15);
+                                z = (z ^ (z >> 30)) * 0xbf58'476d'1ce4'e5b9;
+                                z = (z ^ (z >> 27)) * 0x94d0'49bb'1331'11eb;
+                                key = z ^ (z >> 31);
+                        }
+                }
+        }
+};
+
+inline constexpr ZobristTable Zobrist;
+
+
+inline Key rotate_key(Key key) {
+        return key << 32 | key >> 32;
+}
+
+
+inline Key zobrist(PieceType piece, Square sq, bool ours) {
+        return ours ? Zobrist.keys[piece][sq] : rotate_key(Zobrist.keys[piece][sq ^ 56]);
+}
+
+
+// Compute the key of a board from scratch.
+inline Key compute_key(Board const& board)
+{
+        auto squares = board.occupied() | board.en_passant();
+        Key key = 0;
+
+        while (squares) {
+                auto sq = trailing_zeros_and_pop(squares);
+                key ^= zobrist(board.piece_on(sq), sq, board.our >> sq & 1);
+        }
+
+        return key;
+}